@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "roccat-vulcan.h"
+
+// Audio spectrum effect. Reads raw S16LE PCM (or a WAV file) from a pipe,
+// file or stdin and maps band energies onto the keyboard columns.
+//
+// The PCM stream is also the frame clock: every frame consumes one hop
+// worth of samples. Input that arrives faster than real time (files) is
+// paced to its sample rate.
+
+#define RV_AUDIO_RATE      48000
+#define RV_AUDIO_CHANNELS  2
+#define RV_AUDIO_FPS       33
+
+// Real FFT size. Computed as a complex FFT of half the size.
+#define RV_FFT_BITS        11
+#define RV_FFT_SIZE        (1 << RV_FFT_BITS)
+#define RV_FFT_HALF        (RV_FFT_SIZE / 2)
+
+#define RV_AUDIO_MIN_FREQ  40.0f
+#define RV_AUDIO_MAX_FREQ  16000.0f
+
+// Peak level decay per frame, and bar fall-off per frame (in keys)
+#define RV_AUDIO_AGC_DECAY 0.995f
+// Lowest peak level, a sine at about -40dBFS. Quieter input, like the
+// noise floor of a silent source, is not scaled up to full height.
+#define RV_AUDIO_AGC_FLOOR 1.0f
+#define RV_AUDIO_BAR_FALL  0.25f
+
+#define RV_AUDIO_MAX_HOP   (RV_AUDIO_RATE / 10)
+
+typedef struct rv_fft_plan_type {
+	unsigned short bitrev[RV_FFT_HALF];
+	float tw_re[RV_FFT_HALF / 2];    // Twiddles for the complex FFT
+	float tw_im[RV_FFT_HALF / 2];
+	float rtw_re[RV_FFT_HALF];       // Twiddles for the real split step
+	float rtw_im[RV_FFT_HALF];
+	float window[RV_FFT_SIZE];
+} rv_fft_plan;
+
+static rv_fft_plan rv_plan;
+
+// Scratch buffers, all static so the frame loop never allocates
+static float rv_ring[RV_FFT_SIZE];
+static float rv_fft_re[RV_FFT_HALF];
+static float rv_fft_im[RV_FFT_HALF];
+static float rv_power[RV_FFT_HALF + 1];
+static int16_t rv_pcm[RV_AUDIO_MAX_HOP * 8];
+
+static void rv_fft_plan_init() {
+	int i, j;
+
+	for (i = 0; i < RV_FFT_HALF; i++) {
+		int r = 0;
+		for (j = 0; j < RV_FFT_BITS - 1; j++) {
+			if (i & (1 << j)) r |= 1 << (RV_FFT_BITS - 2 - j);
+		}
+		rv_plan.bitrev[i] = r;
+	}
+
+	for (i = 0; i < RV_FFT_HALF / 2; i++) {
+		rv_plan.tw_re[i] =  cosf(2.0f * M_PI * i / RV_FFT_HALF);
+		rv_plan.tw_im[i] = -sinf(2.0f * M_PI * i / RV_FFT_HALF);
+	}
+
+	for (i = 0; i < RV_FFT_HALF; i++) {
+		rv_plan.rtw_re[i] =  cosf(2.0f * M_PI * i / RV_FFT_SIZE);
+		rv_plan.rtw_im[i] = -sinf(2.0f * M_PI * i / RV_FFT_SIZE);
+	}
+
+	// Hann window
+	for (i = 0; i < RV_FFT_SIZE; i++) {
+		rv_plan.window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / (RV_FFT_SIZE - 1));
+	}
+}
+
+// In-place iterative radix-2 complex FFT of size RV_FFT_HALF
+static void rv_fft_complex(float *re, float *im) {
+	int i, j, len;
+
+	for (i = 0; i < RV_FFT_HALF; i++) {
+		j = rv_plan.bitrev[i];
+		if (j > i) {
+			float t;
+			t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= RV_FFT_HALF; len <<= 1) {
+		int half = len >> 1;
+		int step = RV_FFT_HALF / len;
+		for (i = 0; i < RV_FFT_HALF; i += len) {
+			for (j = 0; j < half; j++) {
+				float wr = rv_plan.tw_re[j * step];
+				float wi = rv_plan.tw_im[j * step];
+				int a = i + j;
+				int b = a + half;
+				float xr = re[b] * wr - im[b] * wi;
+				float xi = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - xr;
+				im[b] = im[a] - xi;
+				re[a] += xr;
+				im[a] += xi;
+			}
+		}
+	}
+}
+
+// Windowed power spectrum of the ring buffer (oldest sample at 'pos').
+// The real input is packed into a half-size complex FFT, then split.
+static void rv_fft_power(int pos) {
+	int i;
+
+	for (i = 0; i < RV_FFT_HALF; i++) {
+		int n = 2 * i;
+		rv_fft_re[i] = rv_ring[(pos + n)     & (RV_FFT_SIZE - 1)] * rv_plan.window[n];
+		rv_fft_im[i] = rv_ring[(pos + n + 1) & (RV_FFT_SIZE - 1)] * rv_plan.window[n + 1];
+	}
+
+	rv_fft_complex(rv_fft_re, rv_fft_im);
+
+	rv_power[0]           = (rv_fft_re[0] + rv_fft_im[0]) * (rv_fft_re[0] + rv_fft_im[0]);
+	rv_power[RV_FFT_HALF] = (rv_fft_re[0] - rv_fft_im[0]) * (rv_fft_re[0] - rv_fft_im[0]);
+
+	for (i = 1; i < RV_FFT_HALF; i++) {
+		int j = RV_FFT_HALF - i;
+		// Even and odd parts of the packed spectrum
+		float er = 0.5f * (rv_fft_re[i] + rv_fft_re[j]);
+		float ei = 0.5f * (rv_fft_im[i] - rv_fft_im[j]);
+		float odr = 0.5f * (rv_fft_im[i] + rv_fft_im[j]);
+		float odi = 0.5f * (rv_fft_re[j] - rv_fft_re[i]);
+		float xr = er + odr * rv_plan.rtw_re[i] - odi * rv_plan.rtw_im[i];
+		float xi = ei + odr * rv_plan.rtw_im[i] + odi * rv_plan.rtw_re[i];
+		rv_power[i] = xr * xr + xi * xi;
+	}
+}
+
+static int rv_read_full(int fd, void *buf, int len) {
+	int got = 0;
+	while (got < len) {
+		int res = read(fd, (char *)buf + got, len - got);
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) break;
+		got += res;
+	}
+	return got;
+}
+
+// Parse a WAV header if there is one. Returns the number of header bytes
+// that have already been consumed as PCM data (0 or 12), or -1 on error.
+static int rv_audio_wav_header(int fd, unsigned char *head, int *rate, int *channels) {
+	unsigned char chunk[8];
+	unsigned char fmt[16];
+
+	if (memcmp(head, "RIFF", 4) != 0 || memcmp(head + 8, "WAVE", 4) != 0) return 12;
+
+	while (rv_read_full(fd, chunk, 8) == 8) {
+		unsigned int len = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | (chunk[7] << 24);
+		if (memcmp(chunk, "data", 4) == 0) return 0;
+		if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+			if (rv_read_full(fd, fmt, 16) != 16) break;
+			len -= 16;
+			if ((fmt[0] | (fmt[1] << 8)) != 1 || (fmt[14] | (fmt[15] << 8)) != 16) {
+				rv_printf(RV_LOG_NORMAL, "Error: Only 16-bit PCM WAV files are supported\n");
+				return -1;
+			}
+			*channels = fmt[2] | (fmt[3] << 8);
+			*rate     = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | (fmt[7] << 24);
+		}
+		// Skip rest of chunk (padded to even length)
+		len += len & 1;
+		while (len) {
+			int n = len > sizeof(rv_pcm) ? sizeof(rv_pcm) : len;
+			if (rv_read_full(fd, rv_pcm, n) != n) return -1;
+			len -= n;
+		}
+	}
+
+	rv_printf(RV_LOG_NORMAL, "Error: No data in WAV file\n");
+	return -1;
+}
+
+void rv_fx_audio(char *pcm_name) {
+	rv_rgb_map map;
+	unsigned char head[12];
+	int fd, i, k, pos = 0;
+	int rate = RV_AUDIO_RATE;
+	int channels = RV_AUDIO_CHANNELS;
+	int hop, frame_bytes, pending;
+	long long frames = 0;
+	struct timespec start, due;
+	int band_start[RV_NUM_COLS + 1];
+	float level[RV_NUM_COLS];
+	float peak = 1e-3f;
+	rv_rgb low  = { .r = 0x0000, .g = 0x00ff, .b = 0x0000 };
+	rv_rgb mid  = { .r = 0x00ff, .g = 0x00bb, .b = 0x0000 };
+	rv_rgb high = { .r = 0x00ff, .g = 0x0000, .b = 0x0000 };
+
+	if (strcmp(pcm_name, "-") == 0) {
+		fd = STDIN_FILENO;
+	}
+	else {
+		fd = open(pcm_name, O_RDONLY);
+		if (fd < 0) {
+			rv_printf(RV_LOG_NORMAL, "Error: %s\n", strerror(errno));
+			return;
+		}
+	}
+
+	if (rv_read_full(fd, head, sizeof(head)) != sizeof(head)) {
+		rv_printf(RV_LOG_NORMAL, "Error: No audio data on '%s'\n", pcm_name);
+		if (fd != STDIN_FILENO) close(fd);
+		return;
+	}
+	pending = rv_audio_wav_header(fd, head, &rate, &channels);
+	if (pending < 0) {
+		if (fd != STDIN_FILENO) close(fd);
+		return;
+	}
+	if (channels < 1 || channels > 8 || rate < 8000 || rate > 192000) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unsupported audio format (%d Hz, %d channels)\n", rate, channels);
+		if (fd != STDIN_FILENO) close(fd);
+		return;
+	}
+
+	hop = rate / RV_AUDIO_FPS;
+	if (hop > RV_AUDIO_MAX_HOP) hop = RV_AUDIO_MAX_HOP;
+	frame_bytes = hop * channels * sizeof(int16_t);
+
+	rv_printf(RV_LOG_NORMAL, "Reading S16LE audio from '%s' (%d Hz, %d channels)\n", pcm_name, rate, channels);
+
+	rv_fft_plan_init();
+
+	// Logarithmically spaced bands, one per column, at least one bin wide
+	for (i = 0; i <= RV_NUM_COLS; i++) {
+		float f = RV_AUDIO_MIN_FREQ * powf(RV_AUDIO_MAX_FREQ / RV_AUDIO_MIN_FREQ, (float)i / RV_NUM_COLS);
+		band_start[i] = (int)(f * RV_FFT_SIZE / rate);
+		if (band_start[i] > RV_FFT_HALF) band_start[i] = RV_FFT_HALF;
+		if (i && band_start[i] <= band_start[i-1]) band_start[i] = band_start[i-1] + 1;
+	}
+
+	memset(rv_ring, 0, sizeof(rv_ring));
+	memset(level, 0, sizeof(level));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (1) {
+		int got;
+		float energy[RV_NUM_COLS];
+		float max_energy = 0;
+
+		// Non-WAV input: the bytes sniffed for a header are PCM data
+		if (pending) memcpy(rv_pcm, head, pending);
+		got = pending + rv_read_full(fd, (char *)rv_pcm + pending, frame_bytes - pending);
+		pending = 0;
+		if (got < frame_bytes) {
+			rv_printf(RV_LOG_NORMAL, "End of audio input '%s'\n", pcm_name);
+			break;
+		}
+
+		// Mix down to mono into the ring buffer
+		for (i = 0; i < hop; i++) {
+			int sum = 0;
+			for (k = 0; k < channels; k++) sum += rv_pcm[i * channels + k];
+			rv_ring[pos] = (float)sum / (32768.0f * channels);
+			pos = (pos + 1) & (RV_FFT_SIZE - 1);
+		}
+
+		rv_fft_power(pos);
+
+		for (i = 0; i < RV_NUM_COLS; i++) {
+			float sum = 0;
+			for (k = band_start[i]; k < band_start[i+1] && k <= RV_FFT_HALF; k++) sum += rv_power[k];
+			energy[i] = log10f(1.0f + sum);
+			if (energy[i] > max_energy) max_energy = energy[i];
+		}
+
+		// Automatic gain: follow the loudest band, decay slowly
+		peak *= RV_AUDIO_AGC_DECAY;
+		if (max_energy > peak) peak = max_energy;
+		if (peak < RV_AUDIO_AGC_FLOOR) peak = RV_AUDIO_AGC_FLOOR;
+
+		for (k = 0; k < RV_NUM_KEYS; k++) map.key[k] = rv_colors[0];
+
+		for (i = 0; i < RV_NUM_COLS; i++) {
+			int num_keys = 0;
+			float target;
+
+			while (num_keys < RV_MAX_KEYS_PER_COL && rv_cols[rv_topo_model][i][num_keys] != 0xff) num_keys++;
+
+			// Bars rise immediately and fall off slowly
+			target = energy[i] / peak * num_keys;
+			level[i] = (target > level[i]) ? target : (level[i] > RV_AUDIO_BAR_FALL) ? level[i] - RV_AUDIO_BAR_FALL : 0;
+
+			// Columns are listed top to bottom, bars grow from the bottom
+			for (k = 0; k < num_keys; k++) {
+				int height = num_keys - k;
+				unsigned char key = rv_cols[rv_topo_model][i][k];
+				if (level[i] >= height - 0.5f) {
+					map.key[key] = (height * 3 > num_keys * 2) ? high : (height * 3 > num_keys) ? mid : low;
+				}
+			}
+		}
+
+		rv_ctl_poll();
+		rv_config_poll();
+		rv_send_led_map(&map);
+
+		// Do not run ahead of the audio clock
+		frames++;
+		long long ns = start.tv_nsec + frames * hop * 1000000000LL / rate;
+		due.tv_sec  = start.tv_sec + ns / 1000000000LL;
+		due.tv_nsec = ns % 1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+	}
+
+	if (fd != STDIN_FILENO) close(fd);
+}
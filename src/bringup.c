@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "roccat-vulcan.h"
+
+// Device bring-up for the host-driven effects, run as a small dependency
+// graph. Every step gets a thread and starts as soon as the steps it
+// depends on are done, so the slow control handshake overlaps with
+// opening the LED interface and the input devices.
+//
+//   led_open ------------------------+
+//                                    +--> first_frame
+//   ctrl_open ---> ctrl_init --------+
+//   evdev
+//   precompute
+
+enum rv_task_ids {
+	RV_TASK_LED_OPEN,
+	RV_TASK_CTRL_OPEN,
+	RV_TASK_CTRL_INIT,
+	RV_TASK_EVDEV,
+	RV_TASK_PRECOMPUTE,
+	RV_TASK_FIRST_FRAME,
+	RV_NUM_TASKS
+};
+
+#define RV_TASK_BIT(t) (1u << (t))
+
+typedef struct rv_task_type {
+	const char *name;
+	int (*run)();
+	unsigned int deps;
+	const char *error;          // Message when the step fails, NULL if not fatal
+	pthread_t thread;
+	int result;
+	int skipped;                // A step it depends on failed
+	struct timespec start, end;
+} rv_task;
+
+static int rv_bringup_grab;
+
+static int rv_task_ctrl_init()  { return rv_send_init(RV_MODE_FX, -1); }
+static int rv_task_evdev()      { return rv_init_evdev(rv_bringup_grab); }
+static int rv_task_precompute() { rv_key_pos_init(); return RV_SUCCESS; }
+
+static rv_task rv_tasks[RV_NUM_TASKS] = {
+	[RV_TASK_LED_OPEN]    = { "led_open",    rv_open_led_device,  0,                                "Error: Unable to find keyboard\n" },
+	[RV_TASK_CTRL_OPEN]   = { "ctrl_open",   rv_open_ctrl_device, 0,                                "Error: Unable to find keyboard\n" },
+	[RV_TASK_CTRL_INIT]   = { "ctrl_init",   rv_task_ctrl_init,   RV_TASK_BIT(RV_TASK_CTRL_OPEN),   "Error: Failed to send initialization sequence.\n" },
+	[RV_TASK_EVDEV]       = { "evdev",       rv_task_evdev,       0,                                NULL },
+	[RV_TASK_PRECOMPUTE]  = { "precompute",  rv_task_precompute,  0,                                NULL },
+	[RV_TASK_FIRST_FRAME] = { "first_frame", rv_fx_init,          RV_TASK_BIT(RV_TASK_LED_OPEN) |
+	                                                              RV_TASK_BIT(RV_TASK_CTRL_INIT),   "Error: Failed to initialize LEDs\n" },
+};
+
+static pthread_mutex_t rv_tasks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rv_tasks_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int rv_tasks_done = 0;
+static unsigned int rv_tasks_failed = 0;
+
+static double rv_bringup_ms(struct timespec *from, struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static void *rv_task_thread(void *arg) {
+	rv_task *task = arg;
+	unsigned int bit = RV_TASK_BIT(task - rv_tasks);
+
+	pthread_mutex_lock(&rv_tasks_mutex);
+	while ((rv_tasks_done & task->deps) != task->deps) pthread_cond_wait(&rv_tasks_cond, &rv_tasks_mutex);
+	task->skipped = (rv_tasks_failed & task->deps) != 0;
+	pthread_mutex_unlock(&rv_tasks_mutex);
+
+	clock_gettime(CLOCK_MONOTONIC, &task->start);
+	task->result = task->skipped ? RV_FAILURE : task->run();
+	clock_gettime(CLOCK_MONOTONIC, &task->end);
+
+	pthread_mutex_lock(&rv_tasks_mutex);
+	rv_tasks_done |= bit;
+	if (task->result != RV_SUCCESS) rv_tasks_failed |= bit;
+	pthread_cond_broadcast(&rv_tasks_cond);
+	pthread_mutex_unlock(&rv_tasks_mutex);
+
+	return NULL;
+}
+
+int rv_bringup(int evdev_grab) {
+	struct timespec start;
+	double sequential = 0;
+	int t, started = 0, rc = RV_SUCCESS;
+
+	rv_bringup_grab = evdev_grab;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (t = 0; t < RV_NUM_TASKS; t++) {
+		rv_task *task = &rv_tasks[t];
+		if (t == RV_TASK_EVDEV && evdev_grab == RV_BRINGUP_NO_EVDEV) {
+			task->start = task->end = start;
+			pthread_mutex_lock(&rv_tasks_mutex);
+			rv_tasks_done |= RV_TASK_BIT(t);
+			pthread_mutex_unlock(&rv_tasks_mutex);
+			continue;
+		}
+		if (pthread_create(&task->thread, NULL, rv_task_thread, task) != 0) {
+			rv_printf(RV_LOG_NORMAL, "Error: Unable to start bring-up thread\n");
+			rc = RV_FAILURE;
+			break;
+		}
+		started |= RV_TASK_BIT(t);
+	}
+
+	for (t = 0; t < RV_NUM_TASKS; t++) {
+		if (started & RV_TASK_BIT(t)) pthread_join(rv_tasks[t].thread, NULL);
+	}
+	if (rc != RV_SUCCESS) return rc;
+
+	// Report the first fatal step that failed on its own
+	for (t = 0; t < RV_NUM_TASKS; t++) {
+		rv_task *task = &rv_tasks[t];
+		if (task->result != RV_SUCCESS && task->error && !task->skipped) {
+			rv_printf(RV_LOG_NORMAL, "%s", task->error);
+			return RV_FAILURE;
+		}
+	}
+
+	for (t = 0; t < RV_NUM_TASKS; t++) {
+		rv_task *task = &rv_tasks[t];
+		double ms = rv_bringup_ms(&task->start, &task->end);
+		sequential += ms;
+		rv_printf(RV_LOG_VERBOSE, "Bring-up: %-12s %8.1fms .. %8.1fms  (%.1fms)%s\n", task->name,
+			rv_bringup_ms(&start, &task->start), rv_bringup_ms(&start, &task->end), ms,
+			task->result != RV_SUCCESS ? " failed" : "");
+	}
+	rv_printf(RV_LOG_VERBOSE, "Bring-up: first frame after %.1fms, steps took %.1fms in total\n",
+		rv_bringup_ms(&start, &rv_tasks[RV_TASK_FIRST_FRAME].end), sequential);
+
+	return RV_SUCCESS;
+}
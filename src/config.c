@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+#include "roccat-vulcan.h"
+
+// Configuration file, reloaded on SIGHUP or when the file is written.
+//
+//   # Lines are 'name = value', '#' starts a comment
+//   layout = iso
+//   effect = impact
+//   repeat = pulse
+//   particles = 1024
+//   fps    = 30
+//   color  = 0:0,0,119
+//   key    = KEY_ESC:255,0,0
+//
+// 'color' and 'key' take the same values as the -c and -k options and
+// can be repeated. Settings from the command line are the base that
+// every load of the file starts from.
+//
+// The file is parsed by a background thread into a new rv_config. The
+// render loop picks it up with a pointer exchange between two frames,
+// so a reload never stalls or tears a frame.
+
+#define RV_CONFIG_LINE_LENGTH 1024
+
+typedef struct rv_config_type {
+	rv_rgb colors[RV_NUM_COLORS];
+	rv_rgb_map fixed;
+	rv_keyset fixed_mask;
+	int topo_model;
+	int effect;
+	int repeat;
+	int particles;
+	int frame_us;
+} rv_config;
+
+static rv_config rv_config_base;
+static rv_config *rv_config_pending = NULL;
+static char *rv_config_name;
+static pthread_t rv_config_thread;
+
+static char *rv_config_trim(char *s) {
+	char *end;
+	while (*s == ' ' || *s == '\t') s++;
+	end = s + strlen(s);
+	while (end > s && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
+	*end = 0;
+	return s;
+}
+
+// Split 'name = value'. Returns 0 for blank and comment lines.
+static int rv_config_split(char *line, char **name, char **value) {
+	char *eq, *hash = strchr(line, '#');
+
+	if (hash) *hash = 0;
+	line = rv_config_trim(line);
+	if (!*line) return 0;
+
+	eq = strchr(line, '=');
+	if (!eq) return -1;
+	*eq = 0;
+	*name  = rv_config_trim(line);
+	*value = rv_config_trim(eq + 1);
+	return 1;
+}
+
+static int rv_config_set(rv_config *cfg, const char *name, char *value) {
+	rv_rgb rgb;
+	int idx;
+
+	if (strcmp(name, "layout") == 0) {
+		if      (strcmp(value, "iso") == 0)  cfg->topo_model = RV_TOPO_ISO;
+		else if (strcmp(value, "ansi") == 0) cfg->topo_model = RV_TOPO_ANSI;
+		else return RV_FAILURE;
+	}
+	else if (strcmp(name, "effect") == 0) {
+		cfg->effect = rv_get_effect(value);
+		if (cfg->effect < 0) return RV_FAILURE;
+	}
+	else if (strcmp(name, "repeat") == 0) {
+		cfg->repeat = rv_get_repeat_mode(value);
+		if (cfg->repeat < 0) return RV_FAILURE;
+	}
+	else if (strcmp(name, "particles") == 0) {
+		cfg->particles = atoi(value);
+		if (cfg->particles < 1 || cfg->particles > RV_PARTICLES_MAX) return RV_FAILURE;
+	}
+	else if (strcmp(name, "fps") == 0) {
+		idx = atoi(value);
+		if (idx < 1 || idx > 100) return RV_FAILURE;
+		cfg->frame_us = 1000000 / idx;
+	}
+	else if (strcmp(name, "color") == 0) {
+		if (sscanf(value, "%d:%hd,%hd,%hd", &idx, &(rgb.r), &(rgb.g), &(rgb.b)) != 4) return RV_FAILURE;
+		if (idx < 0 || idx >= RV_NUM_COLORS) return RV_FAILURE;
+		cfg->colors[idx] = rgb;
+	}
+	else if (strcmp(name, "key") != 0) {
+		return RV_FAILURE;
+	}
+
+	return RV_SUCCESS;
+}
+
+// Keys are resolved after everything else, since key numbers depend on
+// the layout.
+static int rv_config_set_key(rv_config *cfg, char *value) {
+	char keyname[64];
+	rv_rgb rgb;
+	int k;
+
+	if (sscanf(value, "%63[^:]:%hd,%hd,%hd", keyname, &(rgb.r), &(rgb.g), &(rgb.b)) != 4) return RV_FAILURE;
+	k = rv_get_keycode_for(keyname, cfg->topo_model);
+	if (k < 0) return RV_FAILURE;
+	cfg->fixed.key[k] = rgb;
+	rv_keyset_add(&cfg->fixed_mask, k);
+	return RV_SUCCESS;
+}
+
+static rv_config *rv_config_load() {
+	char line[RV_CONFIG_LINE_LENGTH];
+	char *name, *value;
+	rv_config *cfg;
+	int pass, lineno, res;
+	FILE *in;
+
+	in = fopen(rv_config_name, "r");
+	if (!in) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to open config file '%s': %s\n", rv_config_name, strerror(errno));
+		return NULL;
+	}
+
+	cfg = malloc(sizeof(rv_config));
+	if (!cfg) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to allocate memory for config\n");
+		fclose(in);
+		return NULL;
+	}
+	*cfg = rv_config_base;
+
+	for (pass = 0; pass < 2; pass++) {
+		// A replay keeps the layout and frame time of the recording, and
+		// keys are looked up in that layout
+		if (pass == 1 && rv_replay_active()) {
+			cfg->topo_model = rv_config_base.topo_model;
+			cfg->frame_us   = rv_config_base.frame_us;
+		}
+
+		rewind(in);
+		lineno = 0;
+		while (fgets(line, sizeof(line), in)) {
+			lineno++;
+			res = rv_config_split(line, &name, &value);
+			if (res == 0) continue;
+			if (res > 0) {
+				if (pass == 0) res = rv_config_set(cfg, name, value);
+				else if (strcmp(name, "key") == 0) res = rv_config_set_key(cfg, value);
+				else continue;
+			}
+			if (res != RV_SUCCESS) {
+				rv_printf(RV_LOG_NORMAL, "Error: %s:%d: Unable to parse line\n", rv_config_name, lineno);
+				free(cfg);
+				fclose(in);
+				return NULL;
+			}
+		}
+	}
+
+	fclose(in);
+	return cfg;
+}
+
+// Runs on the render thread, between two frames
+static void rv_config_apply(rv_config *cfg) {
+	int topo_model = rv_topo_model;
+
+	// Key numbers depend on the layout: keys held and queued are dropped,
+	// keys set on the control pipe are moved to the new numbers
+	if (rv_topo_model != cfg->topo_model) {
+		rv_topo_model = cfg->topo_model;
+		rv_key_pos_init();
+		rv_reset_key_state();
+		rv_ctl_remap(topo_model);
+	}
+
+	memcpy(rv_colors, cfg->colors, sizeof(rv_colors));
+	rv_fixed      = cfg->fixed;
+	rv_fixed_mask = cfg->fixed_mask;
+	rv_ctl_merge_fixed();
+	rv_frame_us = cfg->frame_us;
+	rv_effect   = cfg->effect;
+	rv_impact_repeat = cfg->repeat;
+	rv_particles_max = cfg->particles;
+
+	free(cfg);
+}
+
+int rv_config_poll() {
+	rv_config *cfg;
+	int effect = rv_effect;
+
+	if (!__atomic_load_n(&rv_config_pending, __ATOMIC_RELAXED)) return 0;
+	cfg = __atomic_exchange_n(&rv_config_pending, NULL, __ATOMIC_ACQUIRE);
+	if (!cfg) return 0;
+
+	rv_config_apply(cfg);
+	rv_printf(RV_LOG_NORMAL, "Configuration reloaded from '%s'\n", rv_config_name);
+
+	return rv_effect != effect;
+}
+
+static void *rv_config_reload_thread(void *arg) {
+	char buf[sizeof(struct inotify_event) + 256];
+	struct pollfd fds[2];
+	const char *base = strrchr(rv_config_name, '/');
+	char dir[RV_MAX_STR];
+	sigset_t mask;
+	(void)arg;
+
+	base = base ? base + 1 : rv_config_name;
+	if (base == rv_config_name)          strcpy(dir, ".");
+	else if (base == rv_config_name + 1) strcpy(dir, "/");
+	else snprintf(dir, sizeof(dir), "%.*s", (int)(base - rv_config_name - 1), rv_config_name);
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	fds[0].events = POLLIN;
+
+	// Watch the directory, so editors that replace the file are noticed
+	fds[1].fd = inotify_init1(IN_CLOEXEC);
+	fds[1].events = POLLIN;
+	if (fds[1].fd >= 0 && inotify_add_watch(fds[1].fd, dir, IN_CLOSE_WRITE|IN_MOVED_TO) < 0) {
+		rv_printf(RV_LOG_VERBOSE, "Unable to watch '%s', reload with SIGHUP only\n", dir);
+		close(fds[1].fd);
+		fds[1].fd = -1;
+	}
+
+	while (1) {
+		int reload = 0, len;
+		rv_config *cfg, *old;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			struct signalfd_siginfo si;
+			if (read(fds[0].fd, &si, sizeof(si)) == sizeof(si)) reload = 1;
+		}
+		if (fds[1].revents & POLLIN) {
+			len = read(fds[1].fd, buf, sizeof(buf));
+			for (char *p = buf; len > 0 && p < buf + len; ) {
+				struct inotify_event *ev = (struct inotify_event *)p;
+				if (ev->len && strcmp(ev->name, base) == 0) reload = 1;
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		if (!reload) continue;
+
+		cfg = rv_config_load();
+		if (!cfg) {
+			rv_printf(RV_LOG_NORMAL, "Keeping previous configuration\n");
+			continue;
+		}
+
+		// If the last one was never picked up, it is replaced
+		old = __atomic_exchange_n(&rv_config_pending, cfg, __ATOMIC_RELEASE);
+		free(old);
+	}
+
+	return NULL;
+}
+
+int rv_config_open(char *config_name) {
+	rv_config *cfg;
+	sigset_t mask;
+
+	rv_config_name = config_name;
+
+	// Settings from the command line
+	memcpy(rv_config_base.colors, rv_colors, sizeof(rv_colors));
+	rv_config_base.fixed      = rv_fixed;
+	rv_config_base.fixed_mask = rv_fixed_mask;
+	rv_config_base.topo_model = rv_topo_model;
+	rv_config_base.effect     = rv_effect;
+	rv_config_base.repeat     = rv_impact_repeat;
+	rv_config_base.particles  = rv_particles_max;
+	rv_config_base.frame_us   = rv_frame_us;
+
+	cfg = rv_config_load();
+	if (!cfg) return RV_FAILURE;
+	rv_config_apply(cfg);
+	rv_printf(RV_LOG_NORMAL, "Configuration loaded from '%s'\n", rv_config_name);
+
+	// SIGHUP is taken by the reload thread. Block it before any other
+	// thread is started, so they all inherit the mask.
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	if (pthread_create(&rv_config_thread, NULL, rv_config_reload_thread, NULL) != 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to start config reload thread\n");
+		return RV_FAILURE;
+	}
+	pthread_detach(rv_config_thread);
+
+	return RV_SUCCESS;
+}
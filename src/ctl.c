@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "roccat-vulcan.h"
+
+// Control channel. A named pipe that is polled once per frame by the
+// effect loops, so settings can be changed while an effect is running.
+// Commands are one per line, like the commands of the piped mode.
+//
+//   brightness:percent
+//   key:keyName:r,g,b    Set a key to a fixed color ('all' for all keys)
+//   key:keyName:off      Give the key back to the effect
+
+#define RV_CTL_LINE_LENGTH 1024
+
+static int rv_ctl_fd = -1;
+static char rv_ctl_line[RV_CTL_LINE_LENGTH];
+static int rv_ctl_len = 0;
+
+// Keys set or released with 'key:', kept apart from -k and the config
+// file, so they stay in effect over a config reload
+static rv_rgb_map rv_ctl_fixed;
+static rv_keyset rv_ctl_set;
+static rv_keyset rv_ctl_released;
+
+int rv_ctl_open(const char *pipe_name) {
+	struct stat in_stat;
+
+	// Opening read-write keeps the pipe from signalling EOF whenever
+	// the last writer goes away.
+	rv_ctl_fd = open(pipe_name, O_RDWR|O_NONBLOCK);
+	if (rv_ctl_fd < 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: %s\n", strerror(errno));
+		return RV_FAILURE;
+	}
+	if (fstat(rv_ctl_fd, &in_stat) || !S_ISFIFO(in_stat.st_mode)) {
+		rv_printf(RV_LOG_NORMAL, "Error: '%s' is not a pipe\n", pipe_name);
+		close(rv_ctl_fd);
+		rv_ctl_fd = -1;
+		return RV_FAILURE;
+	}
+
+	rv_printf(RV_LOG_NORMAL, "Reading control commands from '%s'\n", pipe_name);
+	return RV_SUCCESS;
+}
+
+static void rv_ctl_fix(int k, int off, rv_rgb rgb) {
+	if (off) {
+		rv_keyset_del(&rv_ctl_set, k);
+		rv_keyset_add(&rv_ctl_released, k);
+	}
+	else {
+		rv_ctl_fixed.key[k] = rgb;
+		rv_keyset_add(&rv_ctl_set, k);
+		rv_keyset_del(&rv_ctl_released, k);
+	}
+}
+
+// Moves the keys set or released with 'key:' to their numbers in the
+// current layout, through their event codes. Keys without one (like FN)
+// keep their number.
+void rv_ctl_remap(int from_topo_model) {
+	rv_rgb_map fixed = rv_ctl_fixed;
+	rv_keyset set, released, moved;
+	int code, from, to;
+
+	memset(&set, 0, sizeof(set));
+	memset(&released, 0, sizeof(released));
+	memset(&moved, 0, sizeof(moved));
+
+	for (code = 0; code <= RV_MAX_EV_CODE; code++) {
+		from = rv_ev2rv[from_topo_model][code];
+		to   = rv_ev2rv[rv_topo_model][code];
+		if (from == 0xff || rv_keyset_has(&moved, from)) continue;
+		rv_keyset_add(&moved, from);
+		if (to == 0xff) continue;
+		if (rv_keyset_has(&rv_ctl_set, from)) {
+			rv_keyset_add(&set, to);
+			fixed.key[to] = rv_ctl_fixed.key[from];
+		}
+		if (rv_keyset_has(&rv_ctl_released, from)) rv_keyset_add(&released, to);
+	}
+	for (from = 0; from < RV_NUM_KEYS; from++) {
+		if (rv_keyset_has(&moved, from)) continue;
+		if (rv_keyset_has(&rv_ctl_set, from)) rv_keyset_add(&set, from);
+		if (rv_keyset_has(&rv_ctl_released, from)) rv_keyset_add(&released, from);
+	}
+
+	rv_ctl_fixed    = fixed;
+	rv_ctl_set      = set;
+	rv_ctl_released = released;
+}
+
+// Puts the keys set or released with 'key:' over rv_fixed. Called after
+// every command and after the config file replaced rv_fixed.
+void rv_ctl_merge_fixed() {
+	int k;
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		if (rv_keyset_has(&rv_ctl_set, k)) {
+			rv_fixed.key[k] = rv_ctl_fixed.key[k];
+			rv_keyset_add(&rv_fixed_mask, k);
+		}
+		else if (rv_keyset_has(&rv_ctl_released, k)) {
+			rv_keyset_del(&rv_fixed_mask, k);
+		}
+	}
+}
+
+static int rv_ctl_key(char *arg) {
+	char keyname[64];
+	rv_rgb rgb;
+	int k, off, n = 0;
+
+	arg[strcspn(arg, "\r\n")] = 0;
+	if (sscanf(arg, "%63[^:]:%hd,%hd,%hd%n", keyname, &(rgb.r), &(rgb.g), &(rgb.b), &n) == 4 && !arg[n]) off = 0;
+	else if (sscanf(arg, "%63[^:]:off%n", keyname, &n) == 1 && n && !arg[n]) off = 1;
+	else return RV_FAILURE;
+
+	if (strcmp(keyname, "all") == 0) {
+		for (k = 0; k < RV_NUM_KEYS; k++) rv_ctl_fix(k, off, rgb);
+	}
+	else {
+		k = rv_get_keycode(keyname);
+		if (k < 0) return RV_FAILURE;
+		rv_ctl_fix(k, off, rgb);
+	}
+	rv_ctl_merge_fixed();
+
+	if (off) rv_printf(RV_LOG_NORMAL, "Key %s released from fixed color\n", keyname);
+	else rv_printf(RV_LOG_NORMAL, "Key %s set to fixed color %hd,%hd,%hd\n", keyname, rgb.r, rgb.g, rgb.b);
+	return RV_SUCCESS;
+}
+
+int rv_ctl_exec(char *line) {
+	int val;
+
+	if (strncmp(line, "key:", 4) == 0) return rv_ctl_key(line + 4);
+
+	if (sscanf(line, "brightness:%d", &val) == 1) {
+		if (val < 0)   val = 0;
+		if (val > 100) val = 100;
+		rv_brightness = val;
+		rv_lut_init();
+		rv_printf(RV_LOG_NORMAL, "Brightness set to %d%%\n", val);
+		return RV_SUCCESS;
+	}
+
+	return RV_FAILURE;
+}
+
+void rv_ctl_poll() {
+	int res, i;
+
+	if (rv_ctl_fd < 0) return;
+
+	while ((res = read(rv_ctl_fd, rv_ctl_line + rv_ctl_len, RV_CTL_LINE_LENGTH - 1 - rv_ctl_len)) > 0) {
+		rv_ctl_len += res;
+
+		while (rv_ctl_len) {
+			char *nl = memchr(rv_ctl_line, '\n', rv_ctl_len);
+			if (!nl) {
+				// Overlong line, drop it
+				if (rv_ctl_len == RV_CTL_LINE_LENGTH - 1) rv_ctl_len = 0;
+				break;
+			}
+
+			*nl = 0;
+			if (rv_ctl_exec(rv_ctl_line) == RV_SUCCESS) {
+				rv_metric_add(RV_METRIC_CTL_PARSED, 1);
+			}
+			else {
+				rv_metric_add(RV_METRIC_CTL_REJECTED, 1);
+				rv_printf(RV_LOG_NORMAL, "Error: Unable to parse control command '%s'\n", rv_ctl_line);
+			}
+
+			i = nl + 1 - rv_ctl_line;
+			memmove(rv_ctl_line, nl + 1, rv_ctl_len - i);
+			rv_ctl_len -= i;
+		}
+	}
+}
@@ -2,23 +2,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <libevdev/libevdev.h>
+#include <libudev.h>
 
 #include "roccat-vulcan.h"
 
 #define RV_MAX_EVDEV_DEVICES 6
+#define RV_EVDEV_BATCH 64
 struct libevdev *rv_evdev[RV_MAX_EVDEV_DEVICES+1];
+int rv_evdev_grab = 0;
 
-unsigned char rv_active_keys[RV_NUM_KEYS];
-unsigned char rv_released_keys[RV_MAX_CONCURRENT_KEYS];
-unsigned char rv_pressed_keys[RV_MAX_CONCURRENT_KEYS];
-unsigned char rv_repeated_keys[RV_MAX_CONCURRENT_KEYS];
+// Keys held on each device, and on all of them
+rv_keyset rv_dev_keys[RV_MAX_EVDEV_DEVICES];
+rv_keyset rv_keys_down;
+
+// Key events in the order they were read, until the effect takes them
+// with rv_next_key_event(). When the queue is full, new events are
+// dropped and counted.
+rv_key_event rv_key_queue[RV_KEY_QUEUE_LENGTH];
+unsigned int rv_key_queue_head = 0;
+unsigned int rv_key_queue_tail = 0;
 
 // Event key code (max 0x2ff) to Vulcan key number (max 144) .
 // 0xff = Not an event code that maps to a Vulcan key.
@@ -125,95 +136,119 @@ unsigned char rv_ev2rv[RV_NUM_TOPO_MODELS][RV_MAX_EV_CODE+1] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff // 0x2f0
 };
 
-#define RV_MAX_CMP_CHARS 4
-int cmp_file(char *fpath, char *string) {
-	char data[RV_MAX_CMP_CHARS];
-	int fd, i;
-	fd = open(fpath, O_RDONLY);
-	if (!fd) return RV_FAILURE;
-	i = read(fd, data, RV_MAX_CMP_CHARS);
-	close(fd);
-	if (i < strlen(string)) return RV_FAILURE;
-	return strncmp(string, data, strlen(string));
-}
+// Is this an event device of a known Vulcan model? Matches on the
+// vendor and product IDs of the input device it belongs to.
+static int rv_is_vulcan_evdev(struct udev_device *dev) {
+	struct udev_device *input = udev_device_get_parent_with_subsystem_devtype(dev, "input", NULL);
+	const char *vendor, *product;
+	int p;
+
+	if (!input) return 0;
+	vendor  = udev_device_get_sysattr_value(input, "id/vendor");
+	product = udev_device_get_sysattr_value(input, "id/product");
+	if (!vendor || !product || strcmp(vendor, RV_VENDOR_STR) != 0) return 0;
 
-int prefix_filter(const struct dirent *entry) {
-	if (strncmp(entry->d_name, RV_INPUT_DEV_PREFIX, strlen(RV_INPUT_DEV_PREFIX)) == 0)
-		return 1;
+	for (p = 0; rv_products_str[p]; p++) {
+		if (strcmp(product, rv_products_str[p]) == 0) return 1;
+	}
 	return 0;
 }
 
 int rv_init_evdev(int grab) {
+	struct udev *udev;
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *cur;
+	int evdev_idx = 0;
 
-	memset(rv_evdev, 0, sizeof(rv_evdev));
-
-	memset(rv_active_keys, 0x00, RV_NUM_KEYS);
-	memset(rv_released_keys, 0xff, RV_MAX_CONCURRENT_KEYS);
-	memset(rv_pressed_keys,  0xff, RV_MAX_CONCURRENT_KEYS);
-	memset(rv_repeated_keys, 0xff, RV_MAX_CONCURRENT_KEYS);
-
-	struct dirent **event_dev_list;
-	int num_devs = scandir(RV_INPUT_DEV_DIR, &event_dev_list, prefix_filter, NULL);
+	// Key events come from a recording
+	if (rv_replay_active()) return RV_SUCCESS;
 
-	int evdev_idx = 0;
-	if (num_devs >= 0) {
-		int p = 0;
-		while (rv_products_str[p]) {
-			for (int i = 0; i < num_devs; i++) {
-				char fpath[RV_MAX_STR+1];
-				snprintf(fpath, RV_MAX_STR, "/sys/class/input/%s/device/id/product", event_dev_list[i]->d_name);
-				if (cmp_file(fpath, rv_products_str[p]) == RV_SUCCESS) {
-					snprintf(fpath, RV_MAX_STR, "/sys/class/input/%s/device/id/vendor", event_dev_list[i]->d_name);
-					if (cmp_file(fpath, RV_VENDOR_STR) == RV_SUCCESS) {
-						char event_dev[RV_MAX_STR+1];
-						snprintf(event_dev, RV_MAX_STR, "/dev/input/%s", event_dev_list[i]->d_name);
-
-						int evdev_fd = open(event_dev, O_RDONLY|O_NONBLOCK);
-						if (evdev_fd >= 0) {
-							struct libevdev *evdev;
-							if (libevdev_new_from_fd(evdev_fd, &evdev) < 0) {
-								close(evdev_fd);
-							}
-							else {
-								if (libevdev_grab(evdev, LIBEVDEV_GRAB) < 0) {
-									rv_printf(RV_LOG_NORMAL, "Event input device %s is in exclusive use, skipping.\n", event_dev);
-									close(evdev_fd);
-								}
-								else {
-									if (!grab) libevdev_grab(evdev, LIBEVDEV_UNGRAB);
-									rv_evdev[evdev_idx++] = evdev;
-									rv_printf(RV_LOG_NORMAL, "Using event input device %s\n", event_dev);
-									if (evdev_idx == RV_MAX_EVDEV_DEVICES) break;
-								}
-							}
-						}
-					}
-				}
+	// Devices may already have been opened during bring-up
+	if (rv_evdev[0]) {
+		if (grab != rv_evdev_grab) {
+			for (evdev_idx = 0; rv_evdev[evdev_idx]; evdev_idx++) {
+				libevdev_grab(rv_evdev[evdev_idx], grab ? LIBEVDEV_GRAB : LIBEVDEV_UNGRAB);
 			}
-			if (evdev_idx == RV_MAX_EVDEV_DEVICES) break;
-			p++;
+			rv_evdev_grab = grab;
 		}
+		return RV_SUCCESS;
 	}
-	else {
-		rv_printf(RV_LOG_VERBOSE, "Error: No event input devices in %s\n", RV_INPUT_DEV_DIR);
+
+	memset(rv_evdev, 0, sizeof(rv_evdev));
+
+	memset(rv_dev_keys, 0, sizeof(rv_dev_keys));
+	memset(&rv_keys_down, 0, sizeof(rv_keys_down));
+	rv_key_queue_head = rv_key_queue_tail = 0;
+
+	udev = rv_udev_acquire();
+	enumerate = udev_enumerate_new(udev);
+	if (!enumerate) {
+		rv_udev_release();
+		rv_printf(RV_LOG_VERBOSE, "Error: Unable to enumerate event input devices\n");
 		return(RV_FAILURE);
 	}
+	udev_enumerate_add_match_subsystem(enumerate, RV_INPUT_SUBSYSTEM);
+	udev_enumerate_add_match_sysname(enumerate, RV_INPUT_SYSNAME);
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(cur, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *dev = udev_device_new_from_syspath(udev, udev_list_entry_get_name(cur));
+		const char *event_dev;
+		int evdev_fd;
+
+		if (!dev) continue;
+		event_dev = udev_device_get_devnode(dev);
+		if (!event_dev || !rv_is_vulcan_evdev(dev)) goto NEXT_ENTRY;
+
+		evdev_fd = open(event_dev, O_RDONLY|O_NONBLOCK);
+		if (evdev_fd >= 0) {
+			struct libevdev *evdev;
+			if (libevdev_new_from_fd(evdev_fd, &evdev) < 0) {
+				close(evdev_fd);
+			}
+			else if (libevdev_grab(evdev, LIBEVDEV_GRAB) < 0) {
+				rv_printf(RV_LOG_NORMAL, "Event input device %s is in exclusive use, skipping.\n", event_dev);
+				libevdev_free(evdev);
+				close(evdev_fd);
+			}
+			else {
+				if (!grab) libevdev_grab(evdev, LIBEVDEV_UNGRAB);
+				// Event times on the same clock the effects use
+				libevdev_set_clock_id(evdev, CLOCK_MONOTONIC);
+				rv_evdev[evdev_idx++] = evdev;
+				rv_printf(RV_LOG_NORMAL, "Using event input device %s\n", event_dev);
+			}
+		}
+		else {
+			rv_printf(RV_LOG_VERBOSE, "Unable to open event input device %s: %s\n", event_dev, strerror(errno));
+		}
 
-	free(event_dev_list);
+		NEXT_ENTRY:
+		udev_device_unref(dev);
+		if (evdev_idx == RV_MAX_EVDEV_DEVICES) break;
+	}
+
+	udev_enumerate_unref(enumerate);
+	rv_udev_release();
 
 	if (!evdev_idx) {
 		rv_printf(RV_LOG_VERBOSE, "Error: No event input device found\n");
 		return(RV_FAILURE);
 	}
 
+	rv_evdev_grab = grab;
 	return RV_SUCCESS;
 }
 
-int rv_get_keycode(char *ev_keyname) {
+int rv_get_keycode_for(const char *ev_keyname, int topo_model) {
 	if (strncmp("KEY_FN", ev_keyname, 7) == 0) return 76;
 	int ev_code = libevdev_event_code_from_name(EV_KEY, ev_keyname);
 	if (ev_code < 0 || ev_code > 254) return -1;
-	return (rv_ev2rv[rv_topo_model][ev_code] == 0xff) ? -1 : rv_ev2rv[rv_topo_model][ev_code];
+	return (rv_ev2rv[topo_model][ev_code] == 0xff) ? -1 : rv_ev2rv[topo_model][ev_code];
+}
+
+int rv_get_keycode(char *ev_keyname) {
+	return rv_get_keycode_for(ev_keyname, rv_topo_model);
 }
 
 const char *rv_get_ev_keyname(int ev_code) {
@@ -229,7 +264,13 @@ int rv_get_evdev_keypress() {
 	while(rv_evdev[evdev_idx]) {
 		do {
 			rc = libevdev_next_event(rv_evdev[evdev_idx], LIBEVDEV_READ_FLAG_NORMAL, &ev);
-			if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+			if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+				// Presses lost in the overflow can't be told apart, drop the rest
+				rv_metric_add(RV_METRIC_SYN_DROPPED, 1);
+				while (libevdev_next_event(rv_evdev[evdev_idx], LIBEVDEV_READ_FLAG_SYNC, &ev) == LIBEVDEV_READ_STATUS_SYNC);
+			}
+			else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+				rv_metric_add(RV_METRIC_EVDEV_EVENTS, 1);
 				if (code     == 0 &&
 					ev.type  == EV_KEY &&
 					ev.code  <= RV_MAX_EV_CODE &&
@@ -247,64 +288,162 @@ int rv_get_evdev_keypress() {
 }
 
 
-int rv_update_evdev() {
+static void rv_queue_key_event(const rv_key_event *kev) {
+	if (rv_key_queue_head - rv_key_queue_tail == RV_KEY_QUEUE_LENGTH) {
+		rv_metric_add(RV_METRIC_DROPPED_KEYS, 1);
+		return;
+	}
+	rv_key_queue[rv_key_queue_head++ & (RV_KEY_QUEUE_LENGTH - 1)] = *kev;
+}
+
+int rv_next_key_event(rv_key_event *kev) {
+	if (rv_key_queue_tail == rv_key_queue_head) return 0;
+	*kev = rv_key_queue[rv_key_queue_tail++ & (RV_KEY_QUEUE_LENGTH - 1)];
+	return 1;
+}
+
+// Forgets keys held and queued, whose numbers belong to the previous
+// layout. Keys that are still held only show up again when they repeat.
+void rv_reset_key_state() {
+	memset(rv_dev_keys, 0, sizeof(rv_dev_keys));
+	memset(&rv_keys_down, 0, sizeof(rv_keys_down));
+	rv_key_queue_tail = rv_key_queue_head;
+	rv_metric_set(RV_METRIC_KEYS_HELD, 0);
+}
+
+// Applies a key event of one device to the key state, and queues it for
+// the effect. Returns 1 if it was a Vulcan key.
+static int rv_handle_evdev_event(int evdev_idx, const struct input_event *ev) {
+	rv_key_event kev;
+	int rv_code;
+
+	if (ev->type != EV_KEY || ev->code > RV_MAX_EV_CODE) return 0;
+	rv_code = rv_ev2rv[rv_topo_model][ev->code];
+
+	rv_log_event(ev->type, ev->code, ev->value);
+
+	if (rv_code == 0xff || ev->value > RV_KEY_REPEATED) return 0;
+
+	if (ev->value == RV_KEY_RELEASED) rv_keyset_del(&rv_dev_keys[evdev_idx], rv_code);
+	else                              rv_keyset_add(&rv_dev_keys[evdev_idx], rv_code);
+
+	kev.usec  = ev->time.tv_sec * 1000000ULL + ev->time.tv_usec;
+	kev.key   = rv_code;
+	kev.value = ev->value;
+	rv_queue_key_event(&kev);
+	rv_record_event(&kev);
+	return 1;
+}
+
+// The kernel buffer of a device overflowed (SYN_DROPPED). Events are read
+// raw, past libevdev, so its copy of the device state is of no use here:
+// the key state comes from the kernel instead. Every key is checked
+// against it, stuck keys get a release, keys found down a press, so they
+// still make an impact.
+static int rv_resync_evdev(int evdev_idx) {
+	unsigned char bits[(RV_MAX_EV_CODE + 8) / 8];
+	const unsigned char *ev2rv = rv_ev2rv[rv_topo_model];
 	struct input_event ev;
-	int rc;
+	struct timespec ts;
 	int changes = 0;
-	int num_released_keys = 0;
-	int num_pressed_keys  = 0;
-	int num_repeated_keys = 0;
+	int code;
 
-	memset(rv_released_keys, 0xff, RV_MAX_CONCURRENT_KEYS);
-	memset(rv_pressed_keys,  0xff, RV_MAX_CONCURRENT_KEYS);
-	memset(rv_repeated_keys, 0xff, RV_MAX_CONCURRENT_KEYS);
+	rv_metric_add(RV_METRIC_SYN_DROPPED, 1);
+	rv_printf(RV_LOG_VERBOSE, "Input buffer overflow on event device %d, resyncing\n", evdev_idx);
 
-	int evdev_idx = 0;
-	while(rv_evdev[evdev_idx]) {
-		do {
-			rc = libevdev_next_event(rv_evdev[evdev_idx], LIBEVDEV_READ_FLAG_NORMAL, &ev);
-			if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-				if (ev.type == EV_KEY && ev.code <= RV_MAX_EV_CODE) {
-					int k,i,j;
-					int rv_code = rv_ev2rv[rv_topo_model][ev.code];
-
-					rv_printf(RV_LOG_VERBOSE, "Event: %s(%u) %s(0x%02hhx) VAL(%d)\n",
-						libevdev_event_type_get_name(ev.type),ev.type,
-						libevdev_event_code_get_name(ev.type, ev.code), ev.code, ev.value);
-
-					if (rv_code == 0xff) continue;
-
-					switch (ev.value) {
-						case 0:
-							// Key released
-							rv_active_keys[rv_code] = 0x00;
-							if (num_released_keys < RV_MAX_CONCURRENT_KEYS) {
-								rv_released_keys[num_released_keys++] = rv_code;
-								changes++;
-							}
-						break;
-						case 1:
-							// Key pressed
-							if (num_pressed_keys < RV_MAX_CONCURRENT_KEYS) {
-								rv_pressed_keys[num_pressed_keys++] = rv_code;
-								rv_active_keys[rv_code] = 0x01;
-								changes++;
-							}
-						break;
-						case 2:
-							// Key on repeat
-							if (num_repeated_keys < RV_MAX_CONCURRENT_KEYS) {
-								rv_repeated_keys[num_repeated_keys++] = rv_code;
-								changes++;
-							}
-						break;
-					}
+	memset(bits, 0, sizeof(bits));
+	if (ioctl(libevdev_get_fd(rv_evdev[evdev_idx]), EVIOCGKEY(sizeof(bits)), bits) < 0) {
+		rv_printf(RV_LOG_VERBOSE, "Error: Unable to get key state of event device %d: %s\n", evdev_idx, strerror(errno));
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	memset(&ev, 0, sizeof(ev));
+	ev.time.tv_sec  = ts.tv_sec;
+	ev.time.tv_usec = ts.tv_nsec / 1000;
+	ev.type = EV_KEY;
+	for (code = 0; code <= RV_MAX_EV_CODE; code++) {
+		int down = (bits[code >> 3] >> (code & 7)) & 1;
+
+		if (ev2rv[code] == 0xff || down == rv_keyset_has(&rv_dev_keys[evdev_idx], ev2rv[code])) continue;
+
+		ev.code  = code;
+		ev.value = down ? RV_KEY_PRESSED : RV_KEY_RELEASED;
+		changes += rv_handle_evdev_event(evdev_idx, &ev);
+	}
+
+	return changes;
+}
+
+// Reads all pending events of a device, a batch per read() call. After a
+// SYN_DROPPED, events up to the next SYN_REPORT are incomplete and are
+// skipped before the key state is taken from the kernel.
+static int rv_read_evdev(int evdev_idx) {
+	struct input_event ev[RV_EVDEV_BATCH];
+	int fd = libevdev_get_fd(rv_evdev[evdev_idx]);
+	int changes = 0, dropped = 0;
+	ssize_t len;
+	int i, n = 0;
+
+	do {
+		len = read(fd, ev, sizeof(ev));
+		if (len < (ssize_t)sizeof(ev[0])) break;
+		n = len / sizeof(ev[0]);
+		rv_metric_add(RV_METRIC_EVDEV_EVENTS, n);
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].type == EV_SYN) {
+				if (ev[i].code == SYN_DROPPED) dropped = 1;
+				else if (ev[i].code == SYN_REPORT && dropped) {
+					changes += rv_resync_evdev(evdev_idx);
+					dropped = 0;
 				}
 			}
+			else if (!dropped) {
+				changes += rv_handle_evdev_event(evdev_idx, &ev[i]);
+			}
 		}
-		while (rc >= 0);
+	}
+	while (n == RV_EVDEV_BATCH);
 
-		evdev_idx++;
+	// The end of the report is still in the kernel, sync now anyway
+	if (dropped) changes += rv_resync_evdev(evdev_idx);
+
+	return changes;
+}
+
+int rv_update_evdev() {
+	struct pollfd fds[RV_MAX_EVDEV_DEVICES];
+	rv_key_event kev;
+	int changes = 0;
+
+	// Recorded events stand in for the first device
+	while (rv_replay_active() && rv_replay_next(&kev)) {
+		if (kev.value == RV_KEY_RELEASED) rv_keyset_del(&rv_dev_keys[0], kev.key);
+		else                              rv_keyset_add(&rv_dev_keys[0], kev.key);
+		rv_queue_key_event(&kev);
+		changes++;
+	}
+
+	// One poll for all devices, then one read per batch of a ready one
+	int evdev_idx;
+	for (evdev_idx = 0; rv_evdev[evdev_idx]; evdev_idx++) {
+		fds[evdev_idx].fd     = libevdev_get_fd(rv_evdev[evdev_idx]);
+		fds[evdev_idx].events = POLLIN;
+	}
+	if (evdev_idx && poll(fds, evdev_idx, 0) > 0) {
+		for (evdev_idx = 0; rv_evdev[evdev_idx]; evdev_idx++) {
+			if (fds[evdev_idx].revents & POLLIN) changes += rv_read_evdev(evdev_idx);
+		}
+	}
+
+	if (changes) {
+		int w;
+		memset(&rv_keys_down, 0, sizeof(rv_keys_down));
+		for (evdev_idx = 0; evdev_idx < RV_MAX_EVDEV_DEVICES; evdev_idx++) {
+			for (w = 0; w < RV_KEYSET_WORDS; w++) rv_keys_down.w[w] |= rv_dev_keys[evdev_idx].w[w];
+		}
+		rv_metric_set(RV_METRIC_KEYS_HELD, rv_keyset_count(&rv_keys_down));
 	}
 
 	return changes;
@@ -15,8 +15,6 @@
 #define PIPE_READ_LENGTH 1024
 
 // Rows
-#define RV_NUM_ROWS 6
-#define RV_MAX_KEYS_PER_ROW 22
 unsigned char rv_rows[RV_NUM_TOPO_MODELS][RV_NUM_ROWS][RV_MAX_KEYS_PER_ROW] = {
 
 	// ISO model
@@ -37,8 +35,6 @@ unsigned char rv_rows[RV_NUM_TOPO_MODELS][RV_NUM_ROWS][RV_MAX_KEYS_PER_ROW] = {
 };
 
 // Cols
-#define RV_NUM_COLS 21
-#define RV_MAX_KEYS_PER_COL 6
 unsigned char rv_cols[RV_NUM_TOPO_MODELS][RV_NUM_COLS][RV_MAX_KEYS_PER_COL] = {
 
 	// ISO model
@@ -89,7 +85,6 @@ unsigned char rv_cols[RV_NUM_TOPO_MODELS][RV_NUM_COLS][RV_MAX_KEYS_PER_COL] = {
 };
 
 // Neighbor tables
-#define RV_MAX_NEIGH 10
 unsigned char rv_neigh[RV_NUM_TOPO_MODELS][RV_NUM_KEYS][RV_MAX_NEIGH] = {
 
 	// ISO model
@@ -385,6 +380,35 @@ unsigned char rv_neigh[RV_NUM_TOPO_MODELS][RV_NUM_KEYS][RV_MAX_NEIGH] = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff  // 0x8f
 };
 
+// Row and column number of each key for the active topology model.
+// 0xff = Key is not present in this model.
+unsigned char rv_key_row[RV_NUM_KEYS];
+unsigned char rv_key_col[RV_NUM_KEYS];
+
+void rv_key_pos_init() {
+	int i, j;
+
+	memset(rv_key_row, 0xff, sizeof(rv_key_row));
+	memset(rv_key_col, 0xff, sizeof(rv_key_col));
+
+	for (i = 0; i < RV_NUM_ROWS; i++) {
+		for (j = 0; j < RV_MAX_KEYS_PER_ROW; j++) {
+			unsigned char k = rv_rows[rv_topo_model][i][j];
+			if (k == 0xff) break;
+			rv_key_row[k] = i;
+		}
+	}
+
+	for (i = 0; i < RV_NUM_COLS; i++) {
+		for (j = 0; j < RV_MAX_KEYS_PER_COL; j++) {
+			unsigned char k = rv_cols[rv_topo_model][i][j];
+			if (k == 0xff) break;
+			rv_key_col[k] = i;
+		}
+	}
+
+	rv_raster_init();
+}
 
 void rv_blend_to(rv_rgb_map *src, rv_rgb_map *dst, rv_rgb tc, int amount) {
 	int k, max;
@@ -412,10 +436,41 @@ void rv_blend_to(rv_rgb_map *src, rv_rgb_map *dst, rv_rgb tc, int amount) {
 	}
 }
 
+// Like rv_blend_to(), but moves each key towards its own target color.
+void rv_ease_to(rv_rgb_map *cur, rv_rgb_map *target, int amount) {
+	int k;
+	rv_rgb c, tc;
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		c  = cur->key[k];
+		tc = target->key[k];
+
+		if (abs(tc.r - c.r) < amount) c.r = tc.r;
+		else if (tc.r > c.r) c.r += amount;
+		     else c.r -= amount;
+		if (abs(tc.g - c.g) < amount) c.g = tc.g;
+		else if (tc.g > c.g) c.g += amount;
+		     else c.g -= amount;
+		if (abs(tc.b - c.b) < amount) c.b = tc.b;
+		else if (tc.b > c.b) c.b += amount;
+		     else c.b -= amount;
+
+		cur->key[k] = c;
+	}
+}
+
 int rv_fx_init() {
 	return rv_send_led_map(NULL);
 }
 
+// Wait for the next frame and pick up a reloaded configuration. Returns
+// nonzero if the configuration selected a different effect.
+int rv_frame_end() {
+	if (!rv_replay_fast) rv_frame_wait();
+	rv_clock_tick();
+	return rv_config_poll();
+}
+
 unsigned char rv_wheel_offset(unsigned char pos, char offset) {
 	return pos + offset;
 }
@@ -446,11 +501,50 @@ void rv_schedule_impact(unsigned char n0, rv_rgb_map *wheel[], unsigned char whe
 	}
 }
 
+// Key repeats don't schedule impacts of their own. Each key has an
+// energy that repeats add to, bounded by RV_IMPACT_ENERGY_MAX, so a frame
+// costs at most one impact per key however fast events come in.
+//  - pulse:   a new impact when the energy is full, every few repeats.
+//             It decays in frames without a repeat, so a key that was
+//             let go halfway starts over.
+//  - sustain: the key is lit with the typing color, by its energy, which
+//             repeats keep full and which decays once the key is let go.
+#define RV_IMPACT_ENERGY_MAX 256
+#define RV_IMPACT_PULSE_STEP  64    // A pulse every 4 repeats
+#define RV_IMPACT_DECAY       16    // Per frame, ~0.5s from full to none
+
+const char *rv_effect_names[RV_NUM_EFFECTS] = {
+	[RV_EFFECT_IMPACT]  = "impact",
+	[RV_EFFECT_SYSLOAD] = "sysload",
+	[RV_EFFECT_PLASMA]  = "plasma",
+	[RV_EFFECT_FIRE]    = "fire",
+	[RV_EFFECT_SPARKS]  = "sparks",
+};
+
+int rv_get_effect(const char *name) {
+	int e;
+	for (e = 0; e < RV_NUM_EFFECTS; e++) {
+		if (strcmp(name, rv_effect_names[e]) == 0) return e;
+	}
+	return -1;
+}
+
+int rv_get_repeat_mode(const char *name) {
+	if (strcmp(name, "ignore") == 0)  return RV_REPEAT_IGNORE;
+	if (strcmp(name, "pulse") == 0)   return RV_REPEAT_PULSE;
+	if (strcmp(name, "sustain") == 0) return RV_REPEAT_SUSTAIN;
+	return -1;
+}
+
 void rv_fx_impact() {
 	int k;
 	rv_rgb_map *wheel[256];
 	unsigned char wheel_pos = 0; // Will overflow 255 => 0
 	int ghost_type_pause = 0;
+	rv_key_event kev;
+	unsigned short energy[RV_NUM_KEYS];
+	rv_keyset impacts;
+	rv_keyset repeats;
 
 	memset(wheel, 0x00, sizeof(wheel));
 	while (wheel[wheel_pos] == NULL) {
@@ -464,9 +558,11 @@ void rv_fx_impact() {
 		}
 		wheel_pos++;
 	}
+	memset(energy, 0, sizeof(energy));
 
 	if (rv_init_evdev(0) != RV_SUCCESS) {
 		rv_printf(RV_LOG_NORMAL, "Error: No event input device found\n");
+		for (k = 0; k < 256; k++) free(wheel[k]);
 		return;
 	}
 
@@ -475,26 +571,61 @@ void rv_fx_impact() {
 
 		rv_update_evdev();
 
-		k = 0; while (rv_pressed_keys[k] != 0xff) {
-			rv_schedule_impact(rv_pressed_keys[k], wheel, wheel_pos, 2, 4, rv_colors[1], rv_colors[2], rv_colors[3]);
+		// Events only mark keys, impacts are scheduled once per key below
+		memset(&impacts, 0, sizeof(impacts));
+		memset(&repeats, 0, sizeof(repeats));
+		while (rv_next_key_event(&kev)) {
+			if (kev.value == RV_KEY_RELEASED) continue;
 			ghost_type_pause = 150; // ~5secs
-			k++;
+
+			if (kev.value == RV_KEY_PRESSED) {
+				rv_keyset_add(&impacts, kev.key);
+				energy[kev.key] = 0;
+			}
+			else if (rv_impact_repeat == RV_REPEAT_PULSE) {
+				rv_keyset_add(&repeats, kev.key);
+				energy[kev.key] += RV_IMPACT_PULSE_STEP;
+				if (energy[kev.key] >= RV_IMPACT_ENERGY_MAX) {
+					rv_keyset_add(&impacts, kev.key);
+					energy[kev.key] = 0;
+				}
+			}
+			else if (rv_impact_repeat == RV_REPEAT_SUSTAIN) {
+				energy[kev.key] = RV_IMPACT_ENERGY_MAX;
+			}
 		}
 
-		k = 0; while (rv_repeated_keys[k] != 0xff) {
-			rv_schedule_impact(rv_repeated_keys[k], wheel, wheel_pos, 2, 4, rv_colors[1], rv_colors[2], rv_colors[3]);
-			ghost_type_pause = 150;
-			k++;
+		for (k = 0; k < RV_NUM_KEYS; k++) {
+			if (rv_keyset_has(&impacts, k)) rv_schedule_impact(k, wheel, wheel_pos, 2, 4, rv_colors[1], rv_colors[2], rv_colors[3]);
 		}
 
 		// Ghost typing on random keys
-		if (!ghost_type_pause && (rand() % 8 == 0)) {
-			unsigned char rkey = rand() >> 23;
+		if (!ghost_type_pause && (rv_rand() % 8 == 0)) {
+			unsigned char rkey = rv_rand() >> 24;
 			if (rkey < RV_NUM_KEYS && rv_neigh[rv_topo_model][rkey][0] != 0xff) {
 				rv_schedule_impact(rkey, wheel, wheel_pos, 2, 4, rv_colors[4], rv_colors[5], rv_colors[6]);
 			}
 		}
 
+		if (rv_impact_repeat == RV_REPEAT_PULSE) {
+			for (k = 0; k < RV_NUM_KEYS; k++) {
+				if (rv_keyset_has(&repeats, k)) continue;
+				energy[k] = energy[k] > RV_IMPACT_DECAY ? energy[k] - RV_IMPACT_DECAY : 0;
+			}
+		}
+		else if (rv_impact_repeat == RV_REPEAT_SUSTAIN) {
+			for (k = 0; k < RV_NUM_KEYS; k++) {
+				rv_rgb *c = &wheel[wheel_pos]->key[k];
+				int e = energy[k];
+				if (!e) continue;
+				c->r += (rv_colors[1].r - c->r) * e / RV_IMPACT_ENERGY_MAX;
+				c->g += (rv_colors[1].g - c->g) * e / RV_IMPACT_ENERGY_MAX;
+				c->b += (rv_colors[1].b - c->b) * e / RV_IMPACT_ENERGY_MAX;
+				energy[k] = e > RV_IMPACT_DECAY ? e - RV_IMPACT_DECAY : 0;
+			}
+		}
+
+		rv_ctl_poll();
 		rv_send_led_map(wheel[wheel_pos]);
 
 		rv_blend_to(wheel[wheel_pos], wheel[rv_wheel_offset(wheel_pos, 1)], rv_colors[0], 16);
@@ -506,9 +637,10 @@ void rv_fx_impact() {
 		if (ghost_type_pause) ghost_type_pause--;
 
 		// Runs at ~30fps
-		usleep(30000);
+		if (rv_frame_end()) break;
 	}
 
+	for (k = 0; k < 256; k++) free(wheel[k]);
 }
 
 void rv_fx_topo_keys() {
@@ -565,6 +697,7 @@ void rv_fx_topo_keys() {
 
 void rv_fx_topo_neigh() {
 	rv_rgb_map map;
+	rv_key_event kev;
 	rv_rgb red = { .r = 0x00ff, .g = 0x0000, .b =  0x0000 };
 	rv_rgb grn = { .r = 0x0000, .g = 0x00ff, .b =  0x0000 };
 	rv_rgb off = { .r = 0x0000, .g = 0x0000, .b =  0x0000 };
@@ -592,11 +725,11 @@ void rv_fx_topo_neigh() {
 
 		while (1) {
 			rv_update_evdev();
-			int k = 0; while (rv_pressed_keys[k] != 0xff) {
-				if (rv_pressed_keys[k] == stop_key) goto NEXT_NEIGH;
-				if (map.key[rv_pressed_keys[k]].r == 0x0000)
-					map.key[rv_pressed_keys[k]] = (map.key[rv_pressed_keys[k]].g == 0x0000) ? grn : off;
-				k++;
+			while (rv_next_key_event(&kev)) {
+				if (kev.value != RV_KEY_PRESSED) continue;
+				if (kev.key == stop_key) goto NEXT_NEIGH;
+				if (map.key[kev.key].r == 0x0000)
+					map.key[kev.key] = (map.key[kev.key].g == 0x0000) ? grn : off;
 			}
 			rv_send_led_map(&map);
 			usleep(30000);
@@ -614,6 +747,7 @@ void rv_fx_topo_neigh() {
 
 void rv_fx_topo_cols() {
 	rv_rgb_map map;
+	rv_key_event kev;
 	rv_rgb red = { .r = 0x00ff, .g = 0x0000, .b =  0x0000 };
 	rv_rgb grn = { .r = 0x0000, .g = 0x00ff, .b =  0x0000 };
 	rv_rgb off = { .r = 0x0000, .g = 0x0000, .b =  0x0000 };
@@ -631,11 +765,11 @@ void rv_fx_topo_cols() {
 		rv_printf(RV_LOG_NORMAL, "Activate all keys for column #%u. Press %s when done.\n", colnum+1, stop_key ? "KPENTER" : "ESC" );
 		while (1) {
 			rv_update_evdev();
-			int k = 0; while (rv_pressed_keys[k] != 0xff) {
-				if (rv_pressed_keys[k] == stop_key) goto NEXT_COL;
-				if (map.key[rv_pressed_keys[k]].r == 0x0000)
-					map.key[rv_pressed_keys[k]] = (map.key[rv_pressed_keys[k]].g == 0x0000) ? grn : off;
-				k++;
+			while (rv_next_key_event(&kev)) {
+				if (kev.value != RV_KEY_PRESSED) continue;
+				if (kev.key == stop_key) goto NEXT_COL;
+				if (map.key[kev.key].r == 0x0000)
+					map.key[kev.key] = (map.key[kev.key].g == 0x0000) ? grn : off;
 			}
 			rv_send_led_map(&map);
 			usleep(30000);
@@ -654,6 +788,7 @@ void rv_fx_topo_cols() {
 
 void rv_fx_topo_rows() {
 	rv_rgb_map map;
+	rv_key_event kev;
 	rv_rgb red = { .r = 0x00ff, .g = 0x0000, .b =  0x0000 };
 	rv_rgb grn = { .r = 0x0000, .g = 0x00ff, .b =  0x0000 };
 	rv_rgb off = { .r = 0x0000, .g = 0x0000, .b =  0x0000 };
@@ -671,11 +806,11 @@ void rv_fx_topo_rows() {
 		rv_printf(RV_LOG_NORMAL, "Activate all keys for row #%u. Press %s when done.\n", rownum+1, stop_key ? "KPENTER" : "ESC" );
 		while (1) {
 			rv_update_evdev();
-			int k = 0; while (rv_pressed_keys[k] != 0xff) {
-				if (rv_pressed_keys[k] == stop_key) goto NEXT_ROW;
-				if (map.key[rv_pressed_keys[k]].r == 0x0000)
-					map.key[rv_pressed_keys[k]] = (map.key[rv_pressed_keys[k]].g == 0x0000) ? grn : off;
-				k++;
+			while (rv_next_key_event(&kev)) {
+				if (kev.value != RV_KEY_PRESSED) continue;
+				if (kev.key == stop_key) goto NEXT_ROW;
+				if (map.key[kev.key].r == 0x0000)
+					map.key[kev.key] = (map.key[kev.key].g == 0x0000) ? grn : off;
 			}
 			rv_send_led_map(&map);
 			usleep(30000);
@@ -734,20 +869,27 @@ void rv_fx_piped(char *pipe_name) {
 					for (int i = 0; i < RV_NUM_KEYS; i++) {
 						memcpy(&(rgb_map->key[i]), &rgb, sizeof(rv_rgb));
 					}
+					rv_metric_add(RV_METRIC_PIPE_PARSED, 1);
 					rv_printf(RV_LOG_NORMAL, "All keys set to fixed color %hd,%hd,%hd\n", rgb.r, rgb.g, rgb.b);
 				}
 				else {
 					int k = rv_get_keycode(keyname);
 					if (k >= 0) {
 						memcpy(&(rgb_map->key[k]), &rgb, sizeof(rv_rgb));
+						rv_metric_add(RV_METRIC_PIPE_PARSED, 1);
 						rv_printf(RV_LOG_NORMAL, "Key %s set to fixed color %hd,%hd,%hd\n", keyname, rgb.r, rgb.g, rgb.b);
 					}
 					else {
+						rv_metric_add(RV_METRIC_PIPE_REJECTED, 1);
 						rv_printf(RV_LOG_NORMAL, "Error: Unknown key code '%s'\n", keyname);
 					}
 				}
 			}
+			else if (rv_ctl_exec(buf) == RV_SUCCESS) {
+				rv_metric_add(RV_METRIC_PIPE_PARSED, 1);
+			}
 			else {
+				rv_metric_add(RV_METRIC_PIPE_REJECTED, 1);
 				rv_printf(RV_LOG_NORMAL, "Error: Unable to parse instruction\n");
 			}
 			if (read_rgb_params >= 1) {
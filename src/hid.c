@@ -2,9 +2,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <linux/hidraw.h>
 #include <libudev.h>
@@ -17,9 +21,80 @@
 #define RV_CTRL_INTERFACE 1
 #define RV_LED_INTERFACE  3
 
+// Longest control report (0x0d)
+#define RV_MAX_REPORT_LENGTH 443
+
+// Reports sent by rv_send_init(), after 0x15, in this order
+#define RV_NUM_INIT_REPORTS 8
+static const unsigned char rv_init_reports[RV_NUM_INIT_REPORTS] = {
+	0x05, 0x07, 0x0a, 0x0b, 0x06, 0x09, 0x0d, 0x13
+};
+
+#define RV_INIT_CACHE_NAME  "roccat-vulcan-init"
+#define RV_INIT_CACHE_DIR   "/run/roccat-vulcan"
+#define RV_INIT_CACHE_MAGIC 0x52564931
+
 hid_device *led_device;
 int ctrl_device;
 
+// LED interface, either a hidraw node or through hidapi-libusb (-U)
+static int rv_led_fd = -1;
+int rv_led_libusb = 0;
+
+// Mock transport (-o). LED reports are appended to a file and there is
+// no control interface to initialize.
+static int rv_mock_fd = -1;
+
+// Per-channel output lookup tables (gamma, white point, brightness).
+// Entries are 12.4 fixed point, the fraction is used for dithering.
+// Effects hand over 8-bit colors, so the fraction only comes from the
+// correction: with the defaults, all entries are whole steps.
+#define RV_FB_SHIFT 4
+#define RV_FB_ONE   (1 << RV_FB_SHIFT)
+uint16_t rv_lut[3][256];
+
+// Dither while the frame buffer changes. Once it has been still for this
+// many frames, round and stop, so idle frames can be skipped.
+#define RV_DITHER_SETTLE 30
+
+// 12.4 frame buffer, dither error and last sent map
+uint16_t rv_fb[3][RV_NUM_KEYS];
+uint16_t rv_fb_prev[3][RV_NUM_KEYS];
+unsigned char rv_dither_err[3][RV_NUM_KEYS];
+int rv_fb_still = 0;
+unsigned char rv_hwmap_sent[444];
+int rv_hwmap_valid = 0;
+
+// Sent when there is no effect map, all keys off
+static const rv_rgb_map rv_map_off;
+
+void rv_lut_init() {
+	int c, i;
+	int white[3] = { rv_white.r, rv_white.g, rv_white.b };
+
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < 256; i++) {
+			float v = powf(i / 255.0f, rv_gamma) * white[c] * rv_brightness / 100.0f;
+			rv_lut[c][i] = (v > 255.0f) ? 255 * RV_FB_ONE : (uint16_t)(v * RV_FB_ONE + 0.5f);
+		}
+	}
+}
+
+// One libudev context for all device lookups. libudev is not thread
+// safe, so lookups running during bring-up take turns.
+struct udev *rv_udev = NULL;
+pthread_mutex_t rv_udev_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct udev *rv_udev_acquire() {
+	pthread_mutex_lock(&rv_udev_mutex);
+	if (!rv_udev) rv_udev = udev_new();
+	return rv_udev;
+}
+
+void rv_udev_release() {
+	pthread_mutex_unlock(&rv_udev_mutex);
+}
+
 void rv_close_ctrl_device() {
 	if (ctrl_device) close(ctrl_device);
 	ctrl_device = 0;
@@ -43,16 +118,114 @@ int hidraw_send_feature_report(int fd, unsigned char *buf, int size) {
 	return size;
 }
 
-int rv_open_device() {
+int rv_mock_open(const char *file_name) {
+	rv_mock_fd = open(file_name, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+	if (rv_mock_fd < 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to create '%s': %s\n", file_name, strerror(errno));
+		return RV_FAILURE;
+	}
+	rv_printf(RV_LOG_NORMAL, "Writing LED reports to '%s'\n", file_name);
+	return RV_SUCCESS;
+}
+
+// Find the hidraw nodes of the control and LED interfaces. Both are
+// looked up in one udev enumeration, which is shared by the bring-up
+// steps that open them. Call with the udev context acquired.
+static int rv_hidraw_scanned = 0;
+static char rv_hidraw_ctrl[RV_MAX_STR];
+static char rv_hidraw_led[RV_MAX_STR];
+
+static void rv_hidraw_scan(struct udev *udev) {
+	struct udev_enumerate *enumerate;
+	struct udev_list_entry *cur;
+
+	if (rv_hidraw_scanned) return;
+	rv_hidraw_scanned = 1;
+
+	enumerate = udev_enumerate_new(udev);
+	udev_enumerate_add_match_subsystem(enumerate, "hidraw");
+	udev_enumerate_scan_devices(enumerate);
+
+	udev_list_entry_foreach(cur, udev_enumerate_get_list_entry(enumerate)) {
+		struct udev_device *hid_dev = NULL;
+		struct udev_device *raw_dev = NULL;
+		const char *sysfs_path = udev_list_entry_get_name(cur);
+		unsigned int bus, vendor, product;
+		char *node = NULL;
+		int p, itf;
+		if (!sysfs_path) goto NEXT_ENTRY;
+
+		raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
+		const char *dev_path = udev_device_get_devnode(raw_dev);
+		if (!dev_path) goto NEXT_ENTRY;
+
+		// Match on the HID device rather than the USB interface, so virtual
+		// (uhid) keyboards are found as well
+		hid_dev = udev_device_get_parent_with_subsystem_devtype(raw_dev, "hid", NULL);
+		if (!hid_dev) goto NEXT_ENTRY;
+
+		// HID_ID is bus:vendor:product, HID_PHYS ends in /inputN, where N
+		// is the USB interface number
+		const char *hid_id = udev_device_get_property_value(hid_dev, "HID_ID");
+		const char *phys   = udev_device_get_property_value(hid_dev, "HID_PHYS");
+		if (!hid_id || !phys) goto NEXT_ENTRY;
+		if (sscanf(hid_id, "%x:%x:%x", &bus, &vendor, &product) != 3 || vendor != RV_VENDOR) goto NEXT_ENTRY;
+
+		phys = strrchr(phys, '/');
+		if (!phys || sscanf(phys, "/input%d", &itf) != 1) goto NEXT_ENTRY;
+
+		// We're looking for vid/pid and interface number
+		if      (itf == RV_CTRL_INTERFACE) node = rv_hidraw_ctrl;
+		else if (itf == RV_LED_INTERFACE)  node = rv_hidraw_led;
+		if (!node || node[0]) goto NEXT_ENTRY;
+
+		for (p = 0; rv_products[p]; p++) {
+			if (product == rv_products[p]) {
+				snprintf(node, RV_MAX_STR, "%s", dev_path);
+				break;
+			}
+		}
+
+		NEXT_ENTRY:
+		if (raw_dev) udev_device_unref(raw_dev);
+	}
+	udev_enumerate_unref(enumerate);
+}
+
+// The LED interface takes plain output reports, which can be written to
+// its hidraw node. hidapi-libusb is only used if there is none, e.g.
+// because the kernel driver was detached from the interface earlier.
+static int rv_open_led_hidraw() {
+	char path[RV_MAX_STR];
+
+	rv_hidraw_scan(rv_udev_acquire());
+	snprintf(path, sizeof(path), "%s", rv_hidraw_led);
+	rv_udev_release();
+
+	if (!path[0]) {
+		rv_printf(RV_LOG_VERBOSE, "open_device(%04hx): No hidraw node for LED interface\n", RV_VENDOR);
+		return RV_FAILURE;
+	}
+
+	rv_led_fd = open(path, O_WRONLY|O_CLOEXEC);
+	if (rv_led_fd < 0) {
+		rv_printf(RV_LOG_VERBOSE, "open_device(%04hx): Unable to open LED interface at %s: %s\n", RV_VENDOR, path, strerror(errno));
+		return RV_FAILURE;
+	}
+
+	rv_printf(RV_LOG_NORMAL, "open_device(%04hx): LED interface at %s\n", RV_VENDOR, path);
+	return RV_SUCCESS;
+}
+
+// Fallback for the LED device: hidapi-libusb, which disconnects the
+// interface from the kernel driver.
+static int rv_open_led_libusb() {
 
 	// Loop through product IDs.
 	int p = 0;
 	while (rv_products[p]) {
 		unsigned short product_id = rv_products[p];
 
-		// For LED device, use hidapi-libusb, since we need to disconnect it
-		// from the default kernel driver.
-
 		struct hid_device_info *dev, *devs = NULL;
 		led_device = NULL;
 		devs = hid_enumerate(RV_VENDOR, product_id);
@@ -82,75 +255,68 @@ int rv_open_device() {
 		}
 
 		if (devs) { hid_free_enumeration(devs); devs = NULL; };
-
-		// For CTRL device, use native HIDRAW access. After sending the init
-		// sequence, we will close it.
-
-		struct udev *udev = udev_new();
-		struct udev_enumerate *enumerate = udev_enumerate_new(udev);
-		udev_enumerate_add_match_subsystem(enumerate, "hidraw");
-		udev_enumerate_scan_devices(enumerate);
-
-		struct udev_list_entry *entries = udev_enumerate_get_list_entry(enumerate);
-		struct udev_list_entry *cur;
-		udev_list_entry_foreach(cur, entries) {
-			struct udev_device *usb_dev = NULL;
-			struct udev_device *raw_dev = NULL;
-			const char *sysfs_path = udev_list_entry_get_name(cur);
-			if (!sysfs_path) goto NEXT_ENTRY;
-
-			raw_dev = udev_device_new_from_syspath(udev, sysfs_path);
-			const char *dev_path = udev_device_get_devnode(raw_dev);
-			if (!dev_path) goto NEXT_ENTRY;
-
-			usb_dev = udev_device_get_parent_with_subsystem_devtype(
-				raw_dev,
-				"usb",
-				"usb_interface");
-			if (!usb_dev) goto NEXT_ENTRY;
-
-			const char *info = udev_device_get_sysattr_value(usb_dev, "uevent");
-			if (!info) goto NEXT_ENTRY;
-
-			const char *itf = udev_device_get_sysattr_value(usb_dev, "bInterfaceNumber");
-			if (!itf) goto NEXT_ENTRY;
-
-			// We're looking for vid/pid and interface number
-			if (atoi(itf) == RV_CTRL_INTERFACE) {
-				char searchstr[64];
-				snprintf(searchstr, 64, "PRODUCT=%hx/%hx", RV_VENDOR, product_id);
-
-				if (strstr(info, searchstr) != NULL) {
-					ctrl_device = open(dev_path, O_RDWR|O_NONBLOCK);
-					if (!ctrl_device) {
-						rv_printf(RV_LOG_VERBOSE, "open_device(%04hx, %04hx): Unable to open CTRL device at %s\n", RV_VENDOR, product_id, dev_path);
-						goto NEXT_ENTRY;
-					}
-					rv_printf(RV_LOG_NORMAL, "open_device(%04hx, %04hx): CTRL interface at %s\n", RV_VENDOR, product_id, dev_path);
-					break;
-				}
-			}
-
-			NEXT_ENTRY:
-			if (raw_dev) udev_device_unref(raw_dev);
-		}
-
-		if (!ctrl_device) {
-			rv_printf(RV_LOG_VERBOSE, "open_device(%04hx, %04hx): No CTRL device found\n", RV_VENDOR, product_id);
-			goto NEXT_PRODUCT;
-		}
-
 		return 0;
 
 		NEXT_PRODUCT:
 		if (devs) { hid_free_enumeration(devs); devs = NULL; };
 		if (led_device) hid_close(led_device);
+		led_device = NULL;
 		p++;
 	}
 
 	return -1;
 }
 
+int rv_open_led_device() {
+	if (rv_mock_fd >= 0) return RV_SUCCESS;
+	if (!rv_led_libusb && rv_open_led_hidraw() == RV_SUCCESS) return RV_SUCCESS;
+	return rv_open_led_libusb();
+}
+
+void rv_close_led_device() {
+	if (rv_led_fd >= 0) close(rv_led_fd);
+	rv_led_fd = -1;
+	if (led_device) hid_close(led_device);
+	led_device = NULL;
+}
+
+// For CTRL device, use native HIDRAW access. After sending the init
+// sequence, we will close it.
+int rv_open_ctrl_device() {
+	char path[RV_MAX_STR];
+	int fd;
+
+	if (rv_mock_fd >= 0) return RV_SUCCESS;
+
+	rv_hidraw_scan(rv_udev_acquire());
+	snprintf(path, sizeof(path), "%s", rv_hidraw_ctrl);
+	rv_udev_release();
+
+	if (!path[0]) {
+		rv_printf(RV_LOG_VERBOSE, "open_device(%04hx): No CTRL device found\n", RV_VENDOR);
+		return -1;
+	}
+
+	fd = open(path, O_RDWR|O_NONBLOCK);
+	if (fd < 0) {
+		rv_printf(RV_LOG_VERBOSE, "open_device(%04hx): Unable to open CTRL device at %s\n", RV_VENDOR, path);
+		return -1;
+	}
+	ctrl_device = fd;
+	rv_printf(RV_LOG_NORMAL, "open_device(%04hx): CTRL interface at %s\n", RV_VENDOR, path);
+
+	return 0;
+}
+
+int rv_open_device() {
+	if (rv_open_led_device() < 0) return -1;
+	if (rv_open_ctrl_device() < 0) {
+		rv_close_led_device();
+		return -1;
+	}
+	return 0;
+}
+
 int rv_wait_for_ctrl_device() {
 	unsigned char buffer[] = { 0x04, 0x00, 0x00, 0x00 };
 	int res;
@@ -212,11 +378,11 @@ int rv_get_ctrl_report(unsigned char report_id) {
 }
 
 
-int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt) {
-	int res;
+// Build a control report into 'out' (RV_MAX_REPORT_LENGTH bytes).
+// Returns the report length.
+int rv_build_ctrl_report(unsigned char report_id, int mode, int byteopt, unsigned char *out) {
 	unsigned char *buffer = NULL;
 	int length = 0;
-	int malloced = 0;
 
 	switch(report_id) {
 		case 0x15:
@@ -266,81 +432,7 @@ int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt) {
 			length = 43;
 		break;
 		case 0x0d:
-			length = 443;
-
-			if (mode == RV_MODE_WAVE) {
-				buffer = malloc(length);
-				if (!buffer) {
-					rv_printf(RV_LOG_VERBOSE, "rv_set_ctrl_report(%02hhx): malloc failed\n", report_id);
-					exit(RV_FAILURE);
-				}
-				malloced = 1;
-				memcpy((char *)buffer,"\x0d\xbb\x01\x00\x0a\x04\x05\x45\x83\xca\xca\xca\xca\xca\xca\xce" \
-							"\xce\xd2\xce\xce\xd2\x19\x19\x19\x19\x19\x19\x23\x23\x2d\x23\x23" \
-							"\x2d\xe0\xe0\xe0\xe0\xe0\xe0\xe3\xe3\xe6\xe3\xe3\xe6\xd2\xd2\xd5" \
-							"\xd2\xd2\xd5\xd5\xd5\xd9\xd5\x00\xd9\x2d\x2d\x36\x2d\x2d\x36\x36" \
-							"\x36\x40\x36\x00\x40\xe6\xe6\xe9\xe6\xe6\xe9\xe9\xe9\xec\xe9\x00" \
-							"\xec\xd9\xd9\xdd\xd9\xdd\xdd\xe0\xe0\xdd\xe0\xe4\xe4\x40\x40\x4a" \
-							"\x40\x4a\x4a\x53\x53\x4a\x53\x5d\x5d\xec\xec\xef\xec\xef\xef\xf2" \
-							"\xf2\xef\xf2\xf5\xf5\xe4\xe4\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x5d\x5d\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xf5\xf5\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\xe4\xe4\xe8\xe8\xe8\xe8\xe8" \
-							"\xeb\xeb\xeb\x00\xeb\x5d\x5d\x67\x67\x67\x67\x67\x70\x70\x70\x00" \
-							"\x70\xf5\xf5\xf8\xf8\xf8\xf8\xf8\xfb\xfb\xfb\x00\xfb\xeb\xef\xef" \
-							"\xef\x00\xef\xf0\xf0\xed\xf0\xf0\x00\x70\x7a\x7a\x7a\x00\x7a\x7a" \
-							"\x7a\x6f\x7a\x7a\x00\xfb\xfd\xfd\xfd\x00\xfd\xf8\xf8\xea\xf8\xf8" \
-							"\x00\xed\xed\xea\xed\xed\x00\xed\xea\xea\xf6\xe7\xea\x6f\x6f\x65" \
-							"\x6f\x6f\x00\x6f\x65\x65\x66\x5a\x65\xea\xea\xdc\xea\xea\x00\xea" \
-							"\xdc\xdc\x00\xce\xdc\xea\xe7\xe5\xe7\xe5\xe5\x00\x00\x00\x00\x00" \
-							"\x00\x65\x5a\x50\x5a\x50\x50\x00\x00\x00\x00\x00\x00\xdc\xce\xc0" \
-							"\xce\xc0\xc0\x00\x00\x00\x00\x00\x00\xe7\x00\x00\xe2\xe2\xe2\xe2" \
-							"\xdf\xdf\xdf\xdf\xdf\x5a\x00\x00\x45\x45\x45\x45\x3b\x3b\x3b\x3b" \
-							"\x3b\xce\x00\x00\xb2\xb2\xb2\xb2\xa4\xa4\xa4\xa4\xa4\xdc\xdc\xdc" \
-							"\xdc\x00\xda\xda\xda\xda\xda\x00\xd7\x30\x30\x30\x30\x00\x26\x26" \
-							"\x26\x26\x26\x00\x1c\x96\x96\x96\x96\x00\x88\x88\x88\x88\x88\x00" \
-							"\x7a\xd7\xd7\xd7\x00\xd4\xd4\xd4\xd4\xd4\xd1\xd1\xd1\x1c\x1c\x1c" \
-							"\x00\x11\x11\x11\x11\x11\x06\x06\x06\x7a\x7a\x7a\x00\x6c\x6c\x6c" \
-							"\x6c\x6c\x5e\x5e\x5e\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x21\xcf", length);
-				// byte 5   == 01-slow 06-med 0b-fast
-				// byte 441 == 1e-slow 23-med 28-fast
-				if (byteopt < 1)  byteopt = 1;
-				if (byteopt > 11) byteopt = 11;
-				buffer[5]   = (unsigned char)(byteopt);
-				buffer[441] = (unsigned char)(byteopt + 29);
-			}
-			else {
-				buffer = (unsigned char *)"\x0d\xbb\x01\x00\x06\x0b\x05\x45\x83\xca\xca\xca\xca\xca\xca\xce" \
-							"\xce\xd2\xce\xce\xd2\x19\x19\x19\x19\x19\x19\x23\x23\x2d\x23\x23" \
-							"\x2d\xe0\xe0\xe0\xe0\xe0\xe0\xe3\xe3\xe6\xe3\xe3\xe6\xd2\xd2\xd5" \
-							"\xd2\xd2\xd5\xd5\xd5\xd9\xd5\x00\xd9\x2d\x2d\x36\x2d\x2d\x36\x36" \
-							"\x36\x40\x36\x00\x40\xe6\xe6\xe9\xe6\xe6\xe9\xe9\xe9\xec\xe9\x00" \
-							"\xec\xd9\xd9\xdd\xd9\xdd\xdd\xe0\xe0\xdd\xe0\xe4\xe4\x40\x40\x4a" \
-							"\x40\x4a\x4a\x53\x53\x4a\x53\x5d\x5d\xec\xec\xef\xec\xef\xef\xf2" \
-							"\xf2\xef\xf2\xf5\xf5\xe4\xe4\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x5d\x5d\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xf5\xf5\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\xe4\xe4\xe8\xe8\xe8\xe8\xe8" \
-							"\xeb\xeb\xeb\x00\xeb\x5d\x5d\x67\x67\x67\x67\x67\x70\x70\x70\x00" \
-							"\x70\xf5\xf5\xf8\xf8\xf8\xf8\xf8\xfb\xfb\xfb\x00\xfb\xeb\xef\xef" \
-							"\xef\x00\xef\xf0\xf0\xed\xf0\xf0\x00\x70\x7a\x7a\x7a\x00\x7a\x7a" \
-							"\x7a\x6f\x7a\x7a\x00\xfb\xfd\xfd\xfd\x00\xfd\xf8\xf8\xea\xf8\xf8" \
-							"\x00\xed\xed\xea\xed\xed\x00\xed\xea\xea\xf6\xe7\xea\x6f\x6f\x65" \
-							"\x6f\x6f\x00\x6f\x65\x65\x66\x5a\x65\xea\xea\xdc\xea\xea\x00\xea" \
-							"\xdc\xdc\x00\xce\xdc\xea\xe7\xe5\xe7\xe5\xe5\x00\x00\x00\x00\x00" \
-							"\x00\x65\x5a\x50\x5a\x50\x50\x00\x00\x00\x00\x00\x00\xdc\xce\xc0" \
-							"\xce\xc0\xc0\x00\x00\x00\x00\x00\x00\xe7\x00\x00\xe2\xe2\xe2\xe2" \
-							"\xdf\xdf\xdf\xdf\xdf\x5a\x00\x00\x45\x45\x45\x45\x3b\x3b\x3b\x3b" \
-							"\x3b\xce\x00\x00\xb2\xb2\xb2\xb2\xa4\xa4\xa4\xa4\xa4\xdc\xdc\xdc" \
-							"\xdc\x00\xda\xda\xda\xda\xda\x00\xd7\x30\x30\x30\x30\x00\x26\x26" \
-							"\x26\x26\x26\x00\x1c\x96\x96\x96\x96\x00\x88\x88\x88\x88\x88\x00" \
-							"\x7a\xd7\xd7\xd7\x00\xd4\xd4\xd4\xd4\xd4\xd1\xd1\xd1\x1c\x1c\x1c" \
-							"\x00\x11\x11\x11\x11\x11\x06\x06\x06\x7a\x7a\x7a\x00\x6c\x6c\x6c" \
-							"\x6c\x6c\x5e\x5e\x5e\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" \
-							"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x24\xcf";
-			}
-		break;
+			return rv_hwfx_build_report(mode, byteopt, out);
 		case 0x13:
 			if (mode == RV_MODE_WAVE)
 				buffer = (unsigned char *)"\x13\x08\x00\x00\x00\x00\x00\x00";
@@ -355,8 +447,15 @@ int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt) {
 		exit(RV_FAILURE);
 	}
 
-	res = hidraw_send_feature_report(ctrl_device, buffer, length);
-	if (malloced) free(buffer);
+	memcpy(out, buffer, length);
+	return length;
+}
+
+int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt) {
+	unsigned char buffer[RV_MAX_REPORT_LENGTH];
+	int length = rv_build_ctrl_report(report_id, mode, byteopt, buffer);
+	int res = hidraw_send_feature_report(ctrl_device, buffer, length);
+
 	if (res == length) {
 		rv_printf(RV_LOG_VERBOSE, "rv_set_ctrl_report(%02hhx): %u bytes sent\n", report_id, res);
 		return RV_SUCCESS;
@@ -367,28 +466,77 @@ int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt) {
 	}
 }
 
-int rv_send_led_map(rv_rgb_map *src) {
-	int i, k;
+static int rv_led_write(const unsigned char *buf, int len) {
+	if (rv_mock_fd >= 0) return write(rv_mock_fd, buf, len);
+	if (rv_led_fd >= 0)  return write(rv_led_fd, buf, len);
+	return hid_write(led_device, buf, len);
+}
+
+int rv_send_led_map(const rv_rgb_map *src) {
+	int i, k, c, dither;
 	rv_rgb rgb;
+	struct timespec start, end;
 	// Send seven chunks with 64 bytes each
 	unsigned char hwmap[444];
 	// Plus one byte report ID for the lib
 	unsigned char workbuf[65];
 
-	memset(hwmap, 0, sizeof(hwmap));
-	// Translate linear to hardware map
+	rv_metric_add(RV_METRIC_FRAMES_RENDERED, 1);
+	if (!src) src = &rv_map_off;
+
+	// Translate to 12.4 frame buffer. Fixed keys are selected with a
+	// mask of all ones or all zeros, so there is no branch per key.
 	for (k = 0; k < RV_NUM_KEYS; k++) {
-		rgb = rv_fixed[k] ? *(rv_fixed[k]) : (src ? src->key[k] : rv_color_off);
+		int16_t m = -(int16_t)rv_keyset_has(&rv_fixed_mask, k);
+		rgb.r = (rv_fixed.key[k].r & m) | (src->key[k].r & ~m);
+		rgb.g = (rv_fixed.key[k].g & m) | (src->key[k].g & ~m);
+		rgb.b = (rv_fixed.key[k].b & m) | (src->key[k].b & ~m);
 
 		rgb.r = (rgb.r > 255) ? 255 : (rgb.r < 0) ? 0 : rgb.r;
 		rgb.g = (rgb.g > 255) ? 255 : (rgb.g < 0) ? 0 : rgb.g;
 		rgb.b = (rgb.b > 255) ? 255 : (rgb.b < 0) ? 0 : rgb.b;
 
+		rv_fb[0][k] = rv_lut[0][rgb.r];
+		rv_fb[1][k] = rv_lut[1][rgb.g];
+		rv_fb[2][k] = rv_lut[2][rgb.b];
+	}
+
+	if (memcmp(rv_fb, rv_fb_prev, sizeof(rv_fb)) == 0) {
+		if (rv_fb_still < RV_DITHER_SETTLE) rv_fb_still++;
+	}
+	else {
+		memcpy(rv_fb_prev, rv_fb, sizeof(rv_fb));
+		rv_fb_still = 0;
+	}
+	dither = rv_dither && rv_fb_still < RV_DITHER_SETTLE;
+
+	// Translate linear to hardware map. When dithering, carry the sub-LSB
+	// remainder of each channel over to the next frame.
+	memset(hwmap, 0, sizeof(hwmap));
+	for (k = 0; k < RV_NUM_KEYS; k++) {
 		int offset = ((k / 12) * 36) + (k % 12);
-		hwmap[offset + 0 ] = (unsigned char)rgb.r;
-		hwmap[offset + 12] = (unsigned char)rgb.g;
-		hwmap[offset + 24] = (unsigned char)rgb.b;
+		for (c = 0; c < 3; c++) {
+			if (dither) {
+				int v = rv_fb[c][k] + rv_dither_err[c][k];
+				hwmap[offset + c * 12] = v >> RV_FB_SHIFT;
+				rv_dither_err[c][k] = v & (RV_FB_ONE - 1);
+			}
+			else {
+				hwmap[offset + c * 12] = (rv_fb[c][k] + RV_FB_ONE / 2) >> RV_FB_SHIFT;
+				rv_dither_err[c][k] = 0;
+			}
+		}
+	}
+
+	// Nothing changed on the keyboard, skip the transfer
+	if (rv_hwmap_valid && memcmp(hwmap, rv_hwmap_sent, sizeof(hwmap)) == 0) {
+		rv_metric_add(RV_METRIC_FRAMES_SKIPPED, 1);
+		return RV_SUCCESS;
 	}
+	memcpy(rv_hwmap_sent, hwmap, sizeof(hwmap));
+	rv_hwmap_valid = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	// First chunk comes with header
 	workbuf[0] = 0x00;
@@ -397,7 +545,8 @@ int rv_send_led_map(rv_rgb_map *src) {
 	workbuf[3] = 0x01;
 	workbuf[4] = 0xb4;
 	memcpy(&workbuf[5], hwmap, 60);
-	if (hid_write(led_device, workbuf, 65) != 65) {
+	if (rv_led_write(workbuf, 65) != 65) {
+		rv_metric_add(RV_METRIC_USB_ERRORS, 1);
 		return RV_FAILURE;
 	}
 
@@ -405,37 +554,148 @@ int rv_send_led_map(rv_rgb_map *src) {
 	for (i = 1; i < 7; i++) {
 		workbuf[0] = 0x00;
 		memcpy(&workbuf[1], &hwmap[(i * 64) - 4], 64);
-		if (hid_write(led_device, workbuf, 65) != 65) {
+		if (rv_led_write(workbuf, 65) != 65) {
+			rv_metric_add(RV_METRIC_USB_ERRORS, 1);
 			return RV_FAILURE;
 		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	rv_metric_usb_latency((end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+	rv_metric_add(RV_METRIC_FRAMES_SENT, 1);
+
+	rv_hwmap_valid = 1;
+	return RV_SUCCESS;
+}
+
+// Fingerprints of the control reports, as last sent and as read back
+// from the keyboard. Kept in the runtime directory, so they do not
+// outlive a reboot: $XDG_RUNTIME_DIR, or RV_INIT_CACHE_DIR for root.
+// Other users have no runtime directory of their own, and get no cache.
+// A cache that is not a regular file owned by us is ignored, so nobody
+// else can plant one that skips the init.
+typedef struct rv_init_cache_type {
+	uint32_t magic;
+	uint64_t sent[RV_NUM_INIT_REPORTS];
+	uint64_t read[RV_NUM_INIT_REPORTS];
+} rv_init_cache;
+
+static uint64_t rv_fingerprint(const unsigned char *buf, int len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	while (len--) h = (h ^ *buf++) * 0x100000001b3ULL;
+	return h;
+}
+
+static int rv_init_cache_path(char *path, int size) {
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+
+	if (!dir || !*dir) {
+		if (geteuid() != 0) return RV_FAILURE;
+		dir = RV_INIT_CACHE_DIR;
+		mkdir(dir, 0700);
+		if (lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != 0 || (st.st_mode & 022)) return RV_FAILURE;
+	}
+	snprintf(path, size, "%s/" RV_INIT_CACHE_NAME, dir);
 	return RV_SUCCESS;
 }
 
+static int rv_init_cache_load(rv_init_cache *cache) {
+	char path[RV_MAX_STR];
+	struct stat st;
+	int fd, res;
+
+	if (rv_init_cache_path(path, sizeof(path)) != RV_SUCCESS) return RV_FAILURE;
+	fd = open(path, O_RDONLY|O_NOFOLLOW);
+	if (fd < 0) return RV_FAILURE;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022)) {
+		close(fd);
+		return RV_FAILURE;
+	}
+	res = read(fd, cache, sizeof(*cache));
+	close(fd);
+
+	return (res == sizeof(*cache) && cache->magic == RV_INIT_CACHE_MAGIC) ? RV_SUCCESS : RV_FAILURE;
+}
+
+static void rv_init_cache_save(rv_init_cache *cache) {
+	char path[RV_MAX_STR];
+	char tmp[RV_MAX_STR + 8];
+	int fd, ok;
+
+	if (rv_init_cache_path(path, sizeof(path)) != RV_SUCCESS) return;
+	// A new file, never one that is already there
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) return;
+	cache->magic = RV_INIT_CACHE_MAGIC;
+	ok = write(fd, cache, sizeof(*cache)) == sizeof(*cache);
+	if (close(fd) < 0) ok = 0;
+	if (!ok || rename(tmp, path) < 0) unlink(tmp);
+}
+
+// Fingerprint what the keyboard currently holds for each init report.
+// Reports that cannot be read back get 0, which never matches.
+static void rv_read_init_reports(uint64_t *read) {
+	unsigned char buffer[RV_MAX_REPORT_LENGTH];
+	int i, length;
+
+	for (i = 0; i < RV_NUM_INIT_REPORTS; i++) {
+		length = rv_build_ctrl_report(rv_init_reports[i], RV_MODE_FX, -1, buffer);
+		memset(buffer, 0, length);
+		buffer[0] = rv_init_reports[i];
+		read[i] = hidraw_get_feature_report(ctrl_device, buffer, length) == length ? rv_fingerprint(buffer, length) : 0;
+	}
+}
+
 int rv_send_init(int type, int opt) {
-	int rc =
-		rv_get_ctrl_report(0x0f)             ||
+	unsigned char buffer[RV_MAX_REPORT_LENGTH];
+	rv_init_cache cached, now;
+	int i, length, same = 0;
+	int have_cache;
+	int rc;
+
+	if (rv_mock_fd >= 0) return RV_SUCCESS;
+
+	have_cache = !rv_force_init && rv_init_cache_load(&cached) == RV_SUCCESS;
+	rc = rv_get_ctrl_report(0x0f);
+
+	// Skip the init if nothing differs from the last successful one. If
+	// the keyboard was power cycled or changed by something else, the read
+	// back reports are expected to no longer match. This has not been
+	// checked on every firmware, -F sends everything. Otherwise the whole
+	// sequence is sent, since what 0x15 resets is not known.
+	memset(&now, 0, sizeof(now));
+	rv_read_init_reports(now.read);
+	for (i = 0; i < RV_NUM_INIT_REPORTS; i++) {
+		length = rv_build_ctrl_report(rv_init_reports[i], type, opt, buffer);
+		now.sent[i] = rv_fingerprint(buffer, length);
+		same += have_cache && now.read[i] &&
+		        now.sent[i] == cached.sent[i] && now.read[i] == cached.read[i];
+	}
+
+	if (same == RV_NUM_INIT_REPORTS) {
+		rv_printf(RV_LOG_VERBOSE, "rv_send_init(): Keyboard is already initialized, skipping\n");
+		rv_close_ctrl_device();
+		return rc;
+	}
+	rv_printf(RV_LOG_VERBOSE, "rv_send_init(): %d of %d reports changed, sending all\n", RV_NUM_INIT_REPORTS - same, RV_NUM_INIT_REPORTS);
+
+	rc = rc ||
 		rv_set_ctrl_report(0x15, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x05, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x07, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x0a, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x0b, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x06, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x09, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x0d, type, opt)  ||
-		rv_wait_for_ctrl_device()            ||
-		rv_set_ctrl_report(0x13, type, opt)  ||
 		rv_wait_for_ctrl_device();
 
-		rv_close_ctrl_device();
+	for (i = 0; i < RV_NUM_INIT_REPORTS && !rc; i++) {
+		rc = rv_set_ctrl_report(rv_init_reports[i], type, opt) ||
+		     rv_wait_for_ctrl_device();
+	}
 
-		return rc;
+	if (!rc) {
+		rv_read_init_reports(now.read);
+		rv_init_cache_save(&now);
+	}
+
+	rv_close_ctrl_device();
+
+	return rc;
 }
@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "roccat-vulcan.h"
+
+// Builder for the 0x0d control report, which holds the effect that the
+// keyboard plays on its own (like the wave started by -w).
+//
+//   Byte  0       Report ID (0x0d)
+//   Bytes 1..2    Report length (443), little endian
+//   Byte  3       Always 0
+//   Byte  4       Effect type (RV_HWFX_WAVE, RV_HWFX_HOST)
+//   Byte  5       Speed (1..11)
+//   Bytes 6..8    Unknown, always 05 45 83
+//   Bytes 9..440  Three bytes per key, in the same layout as LED maps:
+//                 groups of 12 keys, each with three planes of 12 bytes
+//   Bytes 441..2  Sum of bytes 0..440, little endian
+//
+// The per-key bytes set where each key is in the animation. In the stock
+// wave, they follow a ramp over the key's column, rising up to about the
+// middle of the keyboard and falling after that. Custom sweeps place the
+// keys on the same ramp by their distance along the sweep direction.
+
+#define RV_HWFX_REPORT_LENGTH 443
+#define RV_HWFX_KEYS_OFFSET   9
+
+typedef struct rv_hwfx_type {
+	unsigned char type;
+	unsigned char speed;
+	unsigned char key[RV_NUM_KEYS][3];
+} rv_hwfx;
+
+// Per-key bytes of the stock wave, as sent by the vendor software
+static const unsigned char rv_hwfx_stock[RV_NUM_KEYS][3] = {
+	{ 0xca, 0x19, 0xe0 }, { 0xca, 0x19, 0xe0 }, { 0xca, 0x19, 0xe0 }, { 0xca, 0x19, 0xe0 }, { 0xca, 0x19, 0xe0 }, { 0xca, 0x19, 0xe0 },
+	{ 0xce, 0x23, 0xe3 }, { 0xce, 0x23, 0xe3 }, { 0xd2, 0x2d, 0xe6 }, { 0xce, 0x23, 0xe3 }, { 0xce, 0x23, 0xe3 }, { 0xd2, 0x2d, 0xe6 },
+	{ 0xd2, 0x2d, 0xe6 }, { 0xd2, 0x2d, 0xe6 }, { 0xd5, 0x36, 0xe9 }, { 0xd2, 0x2d, 0xe6 }, { 0xd2, 0x2d, 0xe6 }, { 0xd5, 0x36, 0xe9 },
+	{ 0xd5, 0x36, 0xe9 }, { 0xd5, 0x36, 0xe9 }, { 0xd9, 0x40, 0xec }, { 0xd5, 0x36, 0xe9 }, { 0x00, 0x00, 0x00 }, { 0xd9, 0x40, 0xec },
+	{ 0xd9, 0x40, 0xec }, { 0xd9, 0x40, 0xec }, { 0xdd, 0x4a, 0xef }, { 0xd9, 0x40, 0xec }, { 0xdd, 0x4a, 0xef }, { 0xdd, 0x4a, 0xef },
+	{ 0xe0, 0x53, 0xf2 }, { 0xe0, 0x53, 0xf2 }, { 0xdd, 0x4a, 0xef }, { 0xe0, 0x53, 0xf2 }, { 0xe4, 0x5d, 0xf5 }, { 0xe4, 0x5d, 0xf5 },
+	{ 0xe4, 0x5d, 0xf5 }, { 0xe4, 0x5d, 0xf5 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 },
+	{ 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 },
+	{ 0xe4, 0x5d, 0xf5 }, { 0xe4, 0x5d, 0xf5 }, { 0xe8, 0x67, 0xf8 }, { 0xe8, 0x67, 0xf8 }, { 0xe8, 0x67, 0xf8 }, { 0xe8, 0x67, 0xf8 },
+	{ 0xe8, 0x67, 0xf8 }, { 0xeb, 0x70, 0xfb }, { 0xeb, 0x70, 0xfb }, { 0xeb, 0x70, 0xfb }, { 0x00, 0x00, 0x00 }, { 0xeb, 0x70, 0xfb },
+	{ 0xeb, 0x70, 0xfb }, { 0xef, 0x7a, 0xfd }, { 0xef, 0x7a, 0xfd }, { 0xef, 0x7a, 0xfd }, { 0x00, 0x00, 0x00 }, { 0xef, 0x7a, 0xfd },
+	{ 0xf0, 0x7a, 0xf8 }, { 0xf0, 0x7a, 0xf8 }, { 0xed, 0x6f, 0xea }, { 0xf0, 0x7a, 0xf8 }, { 0xf0, 0x7a, 0xf8 }, { 0x00, 0x00, 0x00 },
+	{ 0xed, 0x6f, 0xea }, { 0xed, 0x6f, 0xea }, { 0xea, 0x65, 0xdc }, { 0xed, 0x6f, 0xea }, { 0xed, 0x6f, 0xea }, { 0x00, 0x00, 0x00 },
+	{ 0xed, 0x6f, 0xea }, { 0xea, 0x65, 0xdc }, { 0xea, 0x65, 0xdc }, { 0xf6, 0x66, 0x00 }, { 0xe7, 0x5a, 0xce }, { 0xea, 0x65, 0xdc },
+	{ 0xea, 0x65, 0xdc }, { 0xe7, 0x5a, 0xce }, { 0xe5, 0x50, 0xc0 }, { 0xe7, 0x5a, 0xce }, { 0xe5, 0x50, 0xc0 }, { 0xe5, 0x50, 0xc0 },
+	{ 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 },
+	{ 0xe7, 0x5a, 0xce }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0xe2, 0x45, 0xb2 }, { 0xe2, 0x45, 0xb2 }, { 0xe2, 0x45, 0xb2 },
+	{ 0xe2, 0x45, 0xb2 }, { 0xdf, 0x3b, 0xa4 }, { 0xdf, 0x3b, 0xa4 }, { 0xdf, 0x3b, 0xa4 }, { 0xdf, 0x3b, 0xa4 }, { 0xdf, 0x3b, 0xa4 },
+	{ 0xdc, 0x30, 0x96 }, { 0xdc, 0x30, 0x96 }, { 0xdc, 0x30, 0x96 }, { 0xdc, 0x30, 0x96 }, { 0x00, 0x00, 0x00 }, { 0xda, 0x26, 0x88 },
+	{ 0xda, 0x26, 0x88 }, { 0xda, 0x26, 0x88 }, { 0xda, 0x26, 0x88 }, { 0xda, 0x26, 0x88 }, { 0x00, 0x00, 0x00 }, { 0xd7, 0x1c, 0x7a },
+	{ 0xd7, 0x1c, 0x7a }, { 0xd7, 0x1c, 0x7a }, { 0xd7, 0x1c, 0x7a }, { 0x00, 0x00, 0x00 }, { 0xd4, 0x11, 0x6c }, { 0xd4, 0x11, 0x6c },
+	{ 0xd4, 0x11, 0x6c }, { 0xd4, 0x11, 0x6c }, { 0xd4, 0x11, 0x6c }, { 0xd1, 0x06, 0x5e }, { 0xd1, 0x06, 0x5e }, { 0xd1, 0x06, 0x5e },
+	{ 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 },
+	{ 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0x00 },
+};
+
+// Ramp of the stock wave, from the first column to the last
+typedef struct rv_hwfx_stop_type {
+	float pos;
+	float val[3];
+} rv_hwfx_stop;
+
+#define RV_HWFX_NUM_STOPS 3
+static const rv_hwfx_stop rv_hwfx_ramp[RV_HWFX_NUM_STOPS] = {
+	{ 0.00f, { 0xca, 0x19, 0xe0 } },
+	{ 0.45f, { 0xef, 0x7a, 0xfd } },
+	{ 1.00f, { 0xd1, 0x06, 0x5e } }
+};
+
+// Custom sweep set with rv_hwfx_set_sweep()
+static int rv_hwfx_sweep = 0;
+static float rv_hwfx_angle;
+static int rv_hwfx_has_origin = 0;
+static float rv_hwfx_origin_x, rv_hwfx_origin_y;
+
+// Sweep given as 'angle' or 'angle@x,y'. The angle is in degrees, 0 runs
+// from left to right and 90 from top to bottom. With an origin, given in
+// columns and rows, the sweep runs outward from there in both directions.
+int rv_hwfx_set_sweep(const char *spec) {
+	char tail;
+
+	if (sscanf(spec, "%f@%f,%f%c", &rv_hwfx_angle, &rv_hwfx_origin_x, &rv_hwfx_origin_y, &tail) == 3) {
+		rv_hwfx_has_origin = 1;
+	}
+	else if (sscanf(spec, "%f%c", &rv_hwfx_angle, &tail) != 1) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to parse sweep '%s'\n", spec);
+		return RV_FAILURE;
+	}
+
+	rv_hwfx_sweep = 1;
+	return RV_SUCCESS;
+}
+
+static void rv_hwfx_ramp_at(float pos, unsigned char *out) {
+	int s, c;
+
+	for (s = 1; s < RV_HWFX_NUM_STOPS - 1 && pos > rv_hwfx_ramp[s].pos; s++);
+	const rv_hwfx_stop *a = &rv_hwfx_ramp[s - 1], *b = &rv_hwfx_ramp[s];
+	float f = (pos - a->pos) / (b->pos - a->pos);
+
+	if (f < 0.0f) f = 0.0f;
+	if (f > 1.0f) f = 1.0f;
+	for (c = 0; c < 3; c++) out[c] = (unsigned char)(a->val[c] + (b->val[c] - a->val[c]) * f + 0.5f);
+}
+
+static void rv_hwfx_compute_sweep(rv_hwfx *fx) {
+	float dx = cosf(rv_hwfx_angle * M_PI / 180.0f);
+	float dy = sinf(rv_hwfx_angle * M_PI / 180.0f);
+	float dist[RV_NUM_KEYS];
+	float lo = INFINITY, hi = -INFINITY;
+	int k;
+
+	rv_key_pos_init();
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		if (rv_key_col[k] == 0xff || rv_key_row[k] == 0xff) continue;
+		dist[k] = rv_key_col[k] * dx + rv_key_row[k] * dy;
+		if (rv_hwfx_has_origin) dist[k] = fabsf(dist[k] - (rv_hwfx_origin_x * dx + rv_hwfx_origin_y * dy));
+		if (dist[k] < lo) lo = dist[k];
+		if (dist[k] > hi) hi = dist[k];
+	}
+	if (rv_hwfx_has_origin) lo = 0;
+
+	memset(fx->key, 0, sizeof(fx->key));
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		if (rv_key_col[k] == 0xff || rv_key_row[k] == 0xff) continue;
+		rv_hwfx_ramp_at(hi > lo ? (dist[k] - lo) / (hi - lo) : 0.0f, fx->key[k]);
+	}
+}
+
+static int rv_hwfx_pack(const rv_hwfx *fx, unsigned char *out) {
+	uint16_t sum = 0;
+	int i, k, c;
+
+	memset(out, 0, RV_HWFX_REPORT_LENGTH);
+	out[0] = 0x0d;
+	out[1] = RV_HWFX_REPORT_LENGTH & 0xff;
+	out[2] = RV_HWFX_REPORT_LENGTH >> 8;
+	out[4] = fx->type;
+	out[5] = fx->speed;
+	out[6] = 0x05;
+	out[7] = 0x45;
+	out[8] = 0x83;
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		int offset = RV_HWFX_KEYS_OFFSET + ((k / 12) * 36) + (k % 12);
+		for (c = 0; c < 3; c++) out[offset + c * 12] = fx->key[k][c];
+	}
+
+	for (i = 0; i < RV_HWFX_REPORT_LENGTH - 2; i++) sum += out[i];
+	out[RV_HWFX_REPORT_LENGTH - 2] = sum & 0xff;
+	out[RV_HWFX_REPORT_LENGTH - 1] = sum >> 8;
+
+	return RV_HWFX_REPORT_LENGTH;
+}
+
+// The 0x0d report for rv_build_ctrl_report(). In wave mode, this is the
+// stock wave or the custom sweep at the given speed, otherwise the
+// keyboard is handed over to the host.
+int rv_hwfx_build_report(int mode, int speed, unsigned char *out) {
+	rv_hwfx fx;
+
+	if (mode == RV_MODE_WAVE) {
+		if (speed < 1)  speed = 1;
+		if (speed > 11) speed = 11;
+		fx.type  = RV_HWFX_WAVE;
+		fx.speed = speed;
+	}
+	else {
+		fx.type  = RV_HWFX_HOST;
+		fx.speed = 11;
+	}
+
+	if (mode == RV_MODE_WAVE && rv_hwfx_sweep) rv_hwfx_compute_sweep(&fx);
+	else memcpy(fx.key, rv_hwfx_stock, sizeof(fx.key));
+
+	return rv_hwfx_pack(&fx, out);
+}
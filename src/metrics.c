@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "roccat-vulcan.h"
+
+// Metrics in Prometheus text format, served on a unix socket.
+//
+// Every thread that updates a counter gets its own slot, so updates are
+// plain relaxed stores to memory no other thread writes. Slots are only
+// summed up when the endpoint is scraped. Threads beyond the number of
+// slots share an overflow slot, updated with atomic adds.
+//
+//   curl --unix-socket /run/roccat-vulcan.sock http://localhost/metrics
+
+#define RV_METRICS_MAX_THREADS 16
+#define RV_METRICS_OUT_LENGTH  8192
+#define RV_METRICS_REQ_TIMEOUT 100
+
+// Upper bounds of the histogram buckets, in microseconds
+static const unsigned int rv_metrics_usb_buckets[RV_METRIC_USB_BUCKETS] = {
+	250, 500, 1000, 2000, 4000, 8000, 16000, 32000
+};
+static const unsigned int rv_metrics_frame_buckets[RV_METRIC_FRAME_BUCKETS] = {
+	50, 100, 250, 500, 1000, 2000, 5000, 10000
+};
+
+typedef struct rv_metrics_hist_type {
+	const char *name;
+	const char *help;
+	const unsigned int *buckets;
+	int num_buckets;
+	int first;
+	int sum;
+} rv_metrics_hist;
+
+static const rv_metrics_hist rv_metrics_hists[] = {
+	{ "roccat_vulcan_usb_write_seconds", "Time taken by a complete LED map transfer",
+	  rv_metrics_usb_buckets, RV_METRIC_USB_BUCKETS, RV_METRIC_USB_LATENCY, RV_METRIC_USB_LATENCY_SUM },
+	{ "roccat_vulcan_frame_delay_seconds", "How late frames of the host effects start, compared to when they were due",
+	  rv_metrics_frame_buckets, RV_METRIC_FRAME_BUCKETS, RV_METRIC_FRAME_DELAY, RV_METRIC_FRAME_DELAY_SUM },
+};
+#define RV_METRICS_NUM_HISTS (sizeof(rv_metrics_hists) / sizeof(rv_metrics_hists[0]))
+
+typedef struct rv_metrics_desc_type {
+	const char *name;
+	const char *labels;
+	const char *type;
+	const char *help;
+} rv_metrics_desc;
+
+static const rv_metrics_desc rv_metrics_descs[RV_METRIC_USB_LATENCY] = {
+	[RV_METRIC_FRAMES_RENDERED] = { "roccat_vulcan_frames_total", "state=\"rendered\"", "counter", "LED frames handed to the output stage" },
+	[RV_METRIC_FRAMES_SENT]     = { "roccat_vulcan_frames_total", "state=\"sent\"",     "counter", NULL },
+	[RV_METRIC_FRAMES_SKIPPED]  = { "roccat_vulcan_frames_total", "state=\"skipped\"",  "counter", NULL },
+	[RV_METRIC_USB_ERRORS]      = { "roccat_vulcan_usb_write_errors_total", NULL, "counter", "Failed LED map transfers" },
+	[RV_METRIC_EVDEV_EVENTS]    = { "roccat_vulcan_evdev_events_total", NULL, "counter", "Input events read from the keyboard" },
+	[RV_METRIC_DROPPED_KEYS]    = { "roccat_vulcan_dropped_keys_total", NULL, "counter", "Key events dropped because the input queue was full" },
+	[RV_METRIC_SYN_DROPPED]     = { "roccat_vulcan_evdev_syn_dropped_total", NULL, "counter", "Kernel input buffer overflows, followed by a resync" },
+	[RV_METRIC_PIPE_PARSED]     = { "roccat_vulcan_commands_total", "source=\"pipe\",result=\"parsed\"",   "counter", "Commands read from the command and control pipes" },
+	[RV_METRIC_PIPE_REJECTED]   = { "roccat_vulcan_commands_total", "source=\"pipe\",result=\"rejected\"", "counter", NULL },
+	[RV_METRIC_CTL_PARSED]      = { "roccat_vulcan_commands_total", "source=\"ctl\",result=\"parsed\"",    "counter", NULL },
+	[RV_METRIC_CTL_REJECTED]    = { "roccat_vulcan_commands_total", "source=\"ctl\",result=\"rejected\"",  "counter", NULL },
+	[RV_METRIC_KEYS_HELD]       = { "roccat_vulcan_keys_held", NULL, "gauge", "Keys currently held down" },
+	[RV_METRIC_DEADLINE_MISSES] = { "roccat_vulcan_frame_deadline_misses_total", NULL, "counter", "Frames that started more than half a frame time late" },
+	[RV_METRIC_PARTICLES]       = { "roccat_vulcan_particles", NULL, "gauge", "Particles alive in the sparks effect" },
+	[RV_METRIC_PARTICLES_MAX]   = { "roccat_vulcan_particles_max", NULL, "gauge", "Cap on the particles alive at once" },
+	[RV_METRIC_PARTICLES_DROPPED] = { "roccat_vulcan_particles_dropped_total", NULL, "counter", "Particles not spawned because the cap was reached" },
+};
+
+typedef struct rv_metrics_slot_type {
+	uint64_t val[RV_NUM_METRICS];
+} __attribute__((aligned(64))) rv_metrics_slot;
+
+static rv_metrics_slot rv_metrics_slots[RV_METRICS_MAX_THREADS + 1];
+static unsigned int rv_metrics_num_slots = 0;
+static __thread rv_metrics_slot *rv_metrics_local = NULL;
+
+static int rv_metrics_fd = -1;
+static pthread_t rv_metrics_thread;
+
+void rv_metric_add(int metric, uint64_t n) {
+	rv_metrics_slot *slot = rv_metrics_local;
+
+	if (!slot) {
+		unsigned int i = __atomic_fetch_add(&rv_metrics_num_slots, 1, __ATOMIC_RELAXED);
+		slot = rv_metrics_local = &rv_metrics_slots[i < RV_METRICS_MAX_THREADS ? i : RV_METRICS_MAX_THREADS];
+	}
+
+	if (slot == &rv_metrics_slots[RV_METRICS_MAX_THREADS]) {
+		__atomic_add_fetch(&slot->val[metric], n, __ATOMIC_RELAXED);
+	}
+	else {
+		// Only this thread writes to its slot
+		__atomic_store_n(&slot->val[metric], slot->val[metric] + n, __ATOMIC_RELAXED);
+	}
+}
+
+// Gauges are summed like counters, so each one must only be set from
+// a single thread
+void rv_metric_set(int metric, uint64_t n) {
+	rv_metric_add(metric, n - (rv_metrics_local ? rv_metrics_local->val[metric] : 0));
+}
+
+static void rv_metrics_observe(const rv_metrics_hist *h, uint64_t ns) {
+	int b = 0;
+	while (b < h->num_buckets && ns > h->buckets[b] * 1000ULL) b++;
+	rv_metric_add(h->first + b, 1);
+	rv_metric_add(h->sum, ns);
+}
+
+void rv_metric_usb_latency(uint64_t ns) {
+	rv_metrics_observe(&rv_metrics_hists[0], ns);
+}
+
+void rv_metric_frame_delay(uint64_t ns) {
+	rv_metrics_observe(&rv_metrics_hists[1], ns);
+}
+
+static void rv_metrics_sum(uint64_t *total) {
+	int m, s;
+
+	memset(total, 0, RV_NUM_METRICS * sizeof(uint64_t));
+	for (s = 0; s <= RV_METRICS_MAX_THREADS; s++) {
+		for (m = 0; m < RV_NUM_METRICS; m++) {
+			total[m] += __atomic_load_n(&rv_metrics_slots[s].val[m], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static int rv_metrics_format(char *out, int size) {
+	uint64_t total[RV_NUM_METRICS];
+	uint64_t cumulative;
+	int m, h, b, len = 0;
+
+	rv_metrics_sum(total);
+
+	for (m = 0; m < RV_METRIC_USB_LATENCY; m++) {
+		const rv_metrics_desc *d = &rv_metrics_descs[m];
+		if (d->help) {
+			len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s %s\n", d->name, d->help, d->name, d->type);
+		}
+		if (d->labels) len += snprintf(out + len, size - len, "%s{%s} %llu\n", d->name, d->labels, (unsigned long long)total[m]);
+		else           len += snprintf(out + len, size - len, "%s %llu\n", d->name, (unsigned long long)total[m]);
+		if (len >= size) return size;
+	}
+
+	for (h = 0; h < (int)RV_METRICS_NUM_HISTS; h++) {
+		const rv_metrics_hist *d = &rv_metrics_hists[h];
+
+		len += snprintf(out + len, size - len, "# HELP %s %s\n# TYPE %s histogram\n", d->name, d->help, d->name);
+		cumulative = 0;
+		for (b = 0; b <= d->num_buckets; b++) {
+			cumulative += total[d->first + b];
+			if (b < d->num_buckets) {
+				len += snprintf(out + len, size - len, "%s_bucket{le=\"%g\"} %llu\n",
+					d->name, d->buckets[b] / 1e6, (unsigned long long)cumulative);
+			}
+			else {
+				len += snprintf(out + len, size - len, "%s_bucket{le=\"+Inf\"} %llu\n",
+					d->name, (unsigned long long)cumulative);
+			}
+			if (len >= size) return size;
+		}
+		len += snprintf(out + len, size - len, "%s_sum %.6f\n%s_count %llu\n",
+			d->name, total[d->sum] / 1e9, d->name, (unsigned long long)cumulative);
+		if (len >= size) return size;
+	}
+
+	return len < size ? len : size;
+}
+
+static void rv_metrics_serve(int fd) {
+	char out[RV_METRICS_OUT_LENGTH];
+	char req[512];
+	char hdr[128];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int len, hlen = 0, res, off;
+
+	// HTTP clients send a request first, plain socket clients do not
+	if (poll(&pfd, 1, RV_METRICS_REQ_TIMEOUT) > 0 && (res = read(fd, req, sizeof(req) - 1)) > 0) {
+		req[res] = 0;
+		if (strncmp(req, "GET ", 4) == 0) hlen = -1;
+	}
+
+	len = rv_metrics_format(out, sizeof(out));
+	if (hlen < 0) {
+		hlen = snprintf(hdr, sizeof(hdr),
+			"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", len);
+		if (write(fd, hdr, hlen) != hlen) return;
+	}
+	for (off = 0; off < len; off += res) {
+		if ((res = write(fd, out + off, len - off)) <= 0) return;
+	}
+}
+
+static void *rv_metrics_accept_thread(void *arg) {
+	(void)arg;
+	while (1) {
+		int fd = accept(rv_metrics_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) continue;
+			rv_printf(RV_LOG_NORMAL, "Error: Metrics socket: %s\n", strerror(errno));
+			return NULL;
+		}
+		rv_metrics_serve(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int rv_metrics_open(const char *socket_name) {
+	struct sockaddr_un addr;
+	struct stat st;
+
+	if (strlen(socket_name) >= sizeof(addr.sun_path)) {
+		rv_printf(RV_LOG_NORMAL, "Error: Socket path '%s' is too long\n", socket_name);
+		return RV_FAILURE;
+	}
+
+	// Only a stale socket left behind by an earlier run is removed
+	if (lstat(socket_name, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			rv_printf(RV_LOG_NORMAL, "Error: '%s' exists and is not a socket\n", socket_name);
+			return RV_FAILURE;
+		}
+		unlink(socket_name);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_name);
+
+	rv_metrics_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (rv_metrics_fd < 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: %s\n", strerror(errno));
+		return RV_FAILURE;
+	}
+
+	if (bind(rv_metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(rv_metrics_fd, 4) < 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to listen on '%s': %s\n", socket_name, strerror(errno));
+		close(rv_metrics_fd);
+		rv_metrics_fd = -1;
+		return RV_FAILURE;
+	}
+
+	if (pthread_create(&rv_metrics_thread, NULL, rv_metrics_accept_thread, NULL) != 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to start metrics thread\n");
+		close(rv_metrics_fd);
+		rv_metrics_fd = -1;
+		return RV_FAILURE;
+	}
+	pthread_detach(rv_metrics_thread);
+
+	rv_printf(RV_LOG_NORMAL, "Serving metrics on '%s'\n", socket_name);
+	return RV_SUCCESS;
+}
@@ -1,22 +1,225 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "roccat-vulcan.h"
 
+// Once rv_log_start() has been called, output goes through a lock-free
+// single-producer ring of log records. The thread that started logging
+// is the producer; a background thread formats the records and writes
+// them out in batches. Output from other threads is written directly.
+//
+// Records are binary where that saves work on the producer side: input
+// events and byte buffers are only formatted by the writer.
+//
+// When the ring is full, verbose output is dropped (and counted), so it
+// never holds up a frame. Normal output waits for the writer instead:
+// it is what the user asked for, like the keymap of -t keys.
+
+#define RV_LOG_SLOTS        512          // Power of two
+#define RV_LOG_PAYLOAD      248
+#define RV_LOG_FLUSH_US     10000
+#define RV_LOG_WAIT_US      100
+#define RV_LOG_BATCH_LENGTH 8192
+
+enum rv_log_record_types {
+	RV_LOGREC_TEXT,
+	RV_LOGREC_EVENT,
+	RV_LOGREC_BUFFER
+};
+
+typedef struct rv_log_record_type {
+	unsigned char type;
+	unsigned short len;
+	union {
+		char text[RV_LOG_PAYLOAD];
+		unsigned char bytes[RV_LOG_PAYLOAD];
+		struct {
+			int type;
+			int code;
+			int value;
+		} event;
+	} data;
+} rv_log_record;
+
+static rv_log_record rv_log_ring[RV_LOG_SLOTS];
+static unsigned int rv_log_head = 0;     // Written by producer only
+static unsigned int rv_log_tail = 0;     // Written by writer only
+static unsigned int rv_log_dropped = 0;
+static int rv_log_running = 0;
+static int rv_log_stop = 0;
+static pthread_t rv_log_producer;
+static pthread_t rv_log_writer;
+
+static int rv_log_is_producer() {
+	return __atomic_load_n(&rv_log_running, __ATOMIC_ACQUIRE) && pthread_equal(pthread_self(), rv_log_producer);
+}
+
+// Claim the next free slot. If the ring is full, wait for the writer
+// to make room, or return NULL if the record may be dropped.
+static rv_log_record *rv_log_claim(int wait) {
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = RV_LOG_WAIT_US * 1000 };
+	unsigned int head = rv_log_head;
+
+	while (head - __atomic_load_n(&rv_log_tail, __ATOMIC_ACQUIRE) == RV_LOG_SLOTS) {
+		if (!wait) {
+			__atomic_add_fetch(&rv_log_dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+		nanosleep(&pause, NULL);
+	}
+	return &rv_log_ring[head & (RV_LOG_SLOTS - 1)];
+}
+
+static void rv_log_publish() {
+	__atomic_store_n(&rv_log_head, rv_log_head + 1, __ATOMIC_RELEASE);
+}
+
+static int rv_log_format(rv_log_record *rec, char *out, int size) {
+	int i, len = 0;
+
+	switch (rec->type) {
+		case RV_LOGREC_TEXT:
+			len = rec->len < size ? rec->len : size;
+			memcpy(out, rec->data.text, len);
+		break;
+		case RV_LOGREC_EVENT:
+			len = snprintf(out, size, "Event: EV_KEY(%d) %s(0x%02hhx) VAL(%d)\n",
+				rec->data.event.type, rv_get_ev_keyname(rec->data.event.code),
+				(unsigned char)rec->data.event.code, rec->data.event.value);
+		break;
+		case RV_LOGREC_BUFFER:
+			for (i = 0; i < rec->len && len + 4 < size; i++) {
+				len += snprintf(out + len, size - len, "%02hhx ", rec->data.bytes[i]);
+			}
+			out[len++] = '\n';
+		break;
+	}
+
+	return len < size ? len : size;
+}
+
+static int rv_log_write_all(const char *buf, int len) {
+	while (len > 0) {
+		int res = write(STDOUT_FILENO, buf, len);
+		if (res <= 0) return RV_FAILURE;
+		buf += res;
+		len -= res;
+	}
+	return RV_SUCCESS;
+}
+
+// Drain the ring. Only called by the writer thread.
+static void rv_log_drain() {
+	char batch[RV_LOG_BATCH_LENGTH];
+	int len = 0;
+	unsigned int tail = rv_log_tail;
+	unsigned int head = __atomic_load_n(&rv_log_head, __ATOMIC_ACQUIRE);
+	unsigned int dropped = __atomic_exchange_n(&rv_log_dropped, 0, __ATOMIC_RELAXED);
+
+	if (dropped) len = snprintf(batch, sizeof(batch), "[%u log records dropped]\n", dropped);
+
+	while (tail != head) {
+		if (len > RV_LOG_BATCH_LENGTH - 2 * RV_LOG_PAYLOAD) {
+			rv_log_write_all(batch, len);
+			len = 0;
+		}
+		len += rv_log_format(&rv_log_ring[tail & (RV_LOG_SLOTS - 1)], batch + len, RV_LOG_BATCH_LENGTH - len);
+		tail++;
+		__atomic_store_n(&rv_log_tail, tail, __ATOMIC_RELEASE);
+	}
+
+	if (len) rv_log_write_all(batch, len);
+}
+
+static void *rv_log_writer_thread(void *arg) {
+	struct timespec pause = { .tv_sec = 0, .tv_nsec = RV_LOG_FLUSH_US * 1000 };
+	(void)arg;
+
+	while (!__atomic_load_n(&rv_log_stop, __ATOMIC_ACQUIRE)) {
+		rv_log_drain();
+		nanosleep(&pause, NULL);
+	}
+	rv_log_drain();
+
+	return NULL;
+}
+
+void rv_log_end() {
+	if (!rv_log_running) return;
+	__atomic_store_n(&rv_log_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(rv_log_writer, NULL);
+	__atomic_store_n(&rv_log_running, 0, __ATOMIC_RELEASE);
+}
+
+int rv_log_start() {
+	rv_log_producer = pthread_self();
+	if (pthread_create(&rv_log_writer, NULL, rv_log_writer_thread, NULL) != 0) {
+		return RV_FAILURE;
+	}
+	__atomic_store_n(&rv_log_running, 1, __ATOMIC_RELEASE);
+	atexit(rv_log_end);
+	return RV_SUCCESS;
+}
+
+void rv_log_event(int type, int code, int value) {
+	rv_log_record *rec;
+
+	if (!rv_verbose) return;
+	if (!rv_log_is_producer()) {
+		rv_printf(RV_LOG_VERBOSE, "Event: EV_KEY(%d) %s(0x%02hhx) VAL(%d)\n", type, rv_get_ev_keyname(code), code, value);
+		return;
+	}
+
+	if (!(rec = rv_log_claim(0))) return;
+	rec->type = RV_LOGREC_EVENT;
+	rec->data.event.type  = type;
+	rec->data.event.code  = code;
+	rec->data.event.value = value;
+	rv_log_publish();
+}
+
 void rv_print_buffer(unsigned char *buffer, int len) {
-	int i;
+	rv_log_record *rec, tmp;
+	char out[3 * RV_LOG_PAYLOAD + 1];
+
 	// This is always classed as verbose
-	if (rv_verbose) {
-		for (i = 0; i < len; i++) printf("%02hhx ", buffer[i]);
-		printf("\n");
-	}
+	if (!rv_verbose) return;
+
+	if (len > RV_LOG_PAYLOAD) len = RV_LOG_PAYLOAD;
+	rec = rv_log_is_producer() ? rv_log_claim(0) : &tmp;
+	if (!rec) return;
+
+	rec->type = RV_LOGREC_BUFFER;
+	rec->len  = len;
+	memcpy(rec->data.bytes, buffer, len);
+
+	if (rec == &tmp) rv_log_write_all(out, rv_log_format(rec, out, sizeof(out)));
+	else rv_log_publish();
 }
 
 void rv_printf(int verbose, const char *format, ...) {
 	va_list args;
+	rv_log_record *rec;
+	int len;
+
 	if (!verbose || (verbose && rv_verbose)) {
 		va_start(args, format);
-		vprintf(format, args);
+		if (rv_log_is_producer()) {
+			if ((rec = rv_log_claim(!verbose))) {
+				len = vsnprintf(rec->data.text, RV_LOG_PAYLOAD, format, args);
+				rec->type = RV_LOGREC_TEXT;
+				rec->len  = (len < RV_LOG_PAYLOAD) ? len : RV_LOG_PAYLOAD - 1;
+				rv_log_publish();
+			}
+		}
+		else {
+			vprintf(format, args);
+		}
 		va_end(args);
 	}
 }
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+
+#include "roccat-vulcan.h"
+
+// Sparks: key presses emit particles that fly across the raster, bounce
+// off its edges and fade, leaving short trails.
+//
+// Particles live in a fixed pool, with one array per field, and free
+// slots on a free list, so spawning never allocates. The update loop
+// runs over all slots below the highest one in use, 4 at a time with
+// vector types, and without branches: free slots are updated too, they
+// have no life left and are not drawn. Expired particles go back to the
+// free list in a separate pass, which also draws the ones still alive.
+//
+// rv_particles_max (-n, or 'particles' in the config file) caps the
+// particles alive at once. Sparks that would go over it are not spawned
+// and counted in the metrics, with the number alive and the cap.
+
+#define RV_SPARKS_PER_PRESS  32
+#define RV_SPARKS_PER_REPEAT 4
+#define RV_SPARK_SPEED_MIN   12.0f    // Raster pixels per second
+#define RV_SPARK_SPEED_MAX   60.0f
+#define RV_SPARK_LIFE_MIN    0.6f     // Seconds
+#define RV_SPARK_LIFE_MAX    1.8f
+#define RV_SPARK_DRAG        0.6f     // Speed lost per second
+#define RV_SPARK_BOUNCE      0.8f     // Speed kept by a bounce
+#define RV_SPARK_GAIN        8        // A key is 16 pixels, two sparks light it
+#define RV_SPARK_PIXEL_MAX   (255 * 16)
+#define RV_SPARK_TRAIL       0.5f     // Raster kept from the last frame
+
+typedef float rv_v4f __attribute__((vector_size(16)));
+typedef int   rv_v4i __attribute__((vector_size(16)));
+
+typedef struct rv_particle_pool_type {
+	float x[RV_PARTICLES_MAX] __attribute__((aligned(16)));
+	float y[RV_PARTICLES_MAX] __attribute__((aligned(16)));
+	float vx[RV_PARTICLES_MAX] __attribute__((aligned(16)));
+	float vy[RV_PARTICLES_MAX] __attribute__((aligned(16)));
+	float life[RV_PARTICLES_MAX] __attribute__((aligned(16)));  // 1 when spawned, 0 when gone
+	float fade[RV_PARTICLES_MAX] __attribute__((aligned(16)));  // Life lost per second
+	unsigned char alive[RV_PARTICLES_MAX];
+	unsigned short free[RV_PARTICLES_MAX];
+	int num_free;
+	int num_alive;
+	int top;        // Slots from here on are all free
+} rv_particle_pool;
+
+static rv_particle_pool rv_particles;
+
+static void rv_particles_reset() {
+	int i;
+
+	memset(&rv_particles, 0, sizeof(rv_particles));
+	// Lowest slots first, so the slots in use stay packed
+	for (i = 0; i < RV_PARTICLES_MAX; i++) rv_particles.free[i] = RV_PARTICLES_MAX - 1 - i;
+	rv_particles.num_free = RV_PARTICLES_MAX;
+}
+
+// Returns the slot, or -1 when the cap is reached
+static int rv_particle_alloc() {
+	int p;
+
+	if (rv_particles.num_alive >= rv_particles_max || !rv_particles.num_free) return -1;
+	p = rv_particles.free[--rv_particles.num_free];
+	rv_particles.alive[p] = 1;
+	rv_particles.num_alive++;
+	if (p >= rv_particles.top) rv_particles.top = p + 1;
+	return p;
+}
+
+static void rv_particle_release(int p) {
+	rv_particles.alive[p] = 0;
+	rv_particles.life[p] = 0;
+	rv_particles.free[rv_particles.num_free++] = p;
+	rv_particles.num_alive--;
+}
+
+static float rv_spark_rand(float min, float max) {
+	return min + (max - min) * (rv_rand() >> 8) / (float)(1 << 24);
+}
+
+static void rv_sparks_emit(int k, int n) {
+	int x, y, i, p, dropped = 0;
+
+	rv_raster_key_center(k, &x, &y);
+	for (i = 0; i < n; i++) {
+		float angle, speed;
+
+		p = rv_particle_alloc();
+		if (p < 0) {
+			dropped++;
+			continue;
+		}
+		angle = rv_spark_rand(0, 2 * M_PI);
+		speed = rv_spark_rand(RV_SPARK_SPEED_MIN, RV_SPARK_SPEED_MAX);
+		rv_particles.x[p]    = x + 0.5f;
+		rv_particles.y[p]    = y + 0.5f;
+		rv_particles.vx[p]   = cosf(angle) * speed;
+		rv_particles.vy[p]   = sinf(angle) * speed;
+		rv_particles.life[p] = 1;
+		rv_particles.fade[p] = 1 / rv_spark_rand(RV_SPARK_LIFE_MIN, RV_SPARK_LIFE_MAX);
+	}
+	if (dropped) rv_metric_add(RV_METRIC_PARTICLES_DROPPED, dropped);
+}
+
+// Lanes of 'a' where 'mask' is set, of 'b' elsewhere
+static inline rv_v4f rv_v4f_select(rv_v4i mask, rv_v4f a, rv_v4f b) {
+	return (rv_v4f)(((rv_v4i)a & mask) | ((rv_v4i)b & ~mask));
+}
+
+// Moves a coordinate and its velocity by one step, reflecting both at
+// [0, max]. At low frame rates a step can be longer than the raster,
+// what is still outside after one reflection is clamped.
+static inline void rv_sparks_move(rv_v4f *pos, rv_v4f *vel, rv_v4f dt, rv_v4f max) {
+	const rv_v4f zero = { 0, 0, 0, 0 };
+	const rv_v4f bounce = { -RV_SPARK_BOUNCE, -RV_SPARK_BOUNCE, -RV_SPARK_BOUNCE, -RV_SPARK_BOUNCE };
+	rv_v4f p = *pos + *vel * dt;
+	rv_v4i under = p < zero;
+	rv_v4i over  = p > max;
+
+	p = rv_v4f_select(under, zero - p, p);
+	p = rv_v4f_select(over, max + max - p, p);
+	p = rv_v4f_select(p < zero, zero, p);
+	p = rv_v4f_select(p > max, max, p);
+	*vel = rv_v4f_select(under | over, *vel * bounce, *vel);
+	*pos = p;
+}
+
+static void rv_sparks_update(float dt) {
+	const rv_v4f dtv   = { dt, dt, dt, dt };
+	const rv_v4f drag  = { 1 - RV_SPARK_DRAG * dt, 1 - RV_SPARK_DRAG * dt, 1 - RV_SPARK_DRAG * dt, 1 - RV_SPARK_DRAG * dt };
+	const rv_v4f max_x = { RV_RASTER_W - 0.01f, RV_RASTER_W - 0.01f, RV_RASTER_W - 0.01f, RV_RASTER_W - 0.01f };
+	const rv_v4f max_y = { RV_RASTER_H - 0.01f, RV_RASTER_H - 0.01f, RV_RASTER_H - 0.01f, RV_RASTER_H - 0.01f };
+	rv_particle_pool *pp = &rv_particles;
+	int i;
+
+	for (i = 0; i < pp->top; i += 4) {
+		rv_v4f x, y, vx, vy, life, fade;
+
+		memcpy(&x,    &pp->x[i],    sizeof(x));
+		memcpy(&y,    &pp->y[i],    sizeof(y));
+		memcpy(&vx,   &pp->vx[i],   sizeof(vx));
+		memcpy(&vy,   &pp->vy[i],   sizeof(vy));
+		memcpy(&life, &pp->life[i], sizeof(life));
+		memcpy(&fade, &pp->fade[i], sizeof(fade));
+
+		rv_sparks_move(&x, &vx, dtv, max_x);
+		rv_sparks_move(&y, &vy, dtv, max_y);
+		vx *= drag;
+		vy *= drag;
+		life -= fade * dtv;
+
+		memcpy(&pp->x[i],    &x,    sizeof(x));
+		memcpy(&pp->y[i],    &y,    sizeof(y));
+		memcpy(&pp->vx[i],   &vx,   sizeof(vx));
+		memcpy(&pp->vy[i],   &vy,   sizeof(vy));
+		memcpy(&pp->life[i], &life, sizeof(life));
+	}
+}
+
+// Frees expired particles and adds the others to the raster
+static void rv_sparks_draw(rv_raster *ras, const rv_rgb *pal) {
+	int i, top = 0;
+
+	for (i = 0; i < rv_particles.top; i++) {
+		const rv_rgb *c;
+		int x, y, px;
+
+		if (!rv_particles.alive[i]) continue;
+		if (rv_particles.life[i] <= 0) {
+			rv_particle_release(i);
+			continue;
+		}
+		top = i + 1;
+
+		x = rv_particles.x[i];
+		y = rv_particles.y[i];
+		if (x < 0 || x >= RV_RASTER_W || y < 0 || y >= RV_RASTER_H) continue;
+
+		c  = &pal[(int)(rv_particles.life[i] * 255)];
+		px = y * RV_RASTER_W + x;
+		ras->r[px] = fminf(ras->r[px] + c->r * RV_SPARK_GAIN, RV_SPARK_PIXEL_MAX);
+		ras->g[px] = fminf(ras->g[px] + c->g * RV_SPARK_GAIN, RV_SPARK_PIXEL_MAX);
+		ras->b[px] = fminf(ras->b[px] + c->b * RV_SPARK_GAIN, RV_SPARK_PIXEL_MAX);
+	}
+	rv_particles.top = top;
+}
+
+static void rv_sparks_trail(rv_raster *ras) {
+	const rv_v4f keep = { RV_SPARK_TRAIL, RV_SPARK_TRAIL, RV_SPARK_TRAIL, RV_SPARK_TRAIL };
+	float *planes[3] = { ras->r, ras->g, ras->b };
+	int p, i;
+
+	for (p = 0; p < 3; p++) {
+		for (i = 0; i < RV_RASTER_W * RV_RASTER_H; i += 4) {
+			rv_v4f v;
+			memcpy(&v, &planes[p][i], sizeof(v));
+			v *= keep;
+			memcpy(&planes[p][i], &v, sizeof(v));
+		}
+	}
+}
+
+void rv_fx_sparks() {
+	static rv_raster ras;
+	rv_rgb pal[256];
+	rv_rgb_map map;
+	rv_key_event kev;
+	int input, i;
+
+	rv_key_pos_init();
+	input = rv_init_evdev(0) == RV_SUCCESS;
+
+	// By life left: red, orange, yellow, white
+	for (i = 0; i < 256; i++) {
+		pal[i].r = i < 64 ? i * 4 : 255;
+		pal[i].g = i < 64 ? 0 : i < 192 ? (i - 64) * 2 : 255;
+		pal[i].b = i < 192 ? 0 : (i - 192) * 4;
+	}
+	memset(&ras, 0, sizeof(ras));
+	rv_particles_reset();
+
+	while (1) {
+		if (input) {
+			rv_update_evdev();
+			while (rv_next_key_event(&kev)) {
+				if      (kev.value == RV_KEY_PRESSED)  rv_sparks_emit(kev.key, RV_SPARKS_PER_PRESS);
+				else if (kev.value == RV_KEY_REPEATED) rv_sparks_emit(kev.key, RV_SPARKS_PER_REPEAT);
+			}
+		}
+
+		rv_sparks_update(rv_frame_us / 1000000.0f);
+		rv_sparks_trail(&ras);
+		rv_sparks_draw(&ras, pal);
+		rv_metric_set(RV_METRIC_PARTICLES, rv_particles.num_alive);
+		rv_metric_set(RV_METRIC_PARTICLES_MAX, rv_particles_max);
+
+		rv_raster_resample(&ras, &map);
+		rv_ctl_poll();
+		rv_send_led_map(&map);
+
+		if (rv_frame_end()) break;
+	}
+}
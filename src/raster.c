@@ -0,0 +1,322 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <linux/input.h>
+
+#include "roccat-vulcan.h"
+
+// Raster effects.
+//
+// Effects draw into a virtual pixel grid of RV_RASTER_W x RV_RASTER_H
+// that covers the whole keyboard, which is then resampled to the keys.
+// Every key has a physical footprint in key units (a letter key is 1x1,
+// space is 6.25 wide, the numpad enter is 2 rows high), and its color is
+// the average of the pixels under it, weighted by how much of each pixel
+// it covers.
+//
+// The weights are precomputed per layout, as one span per key and pixel
+// row: a run of neighboring pixels in the same plane, padded to a
+// multiple of 4. Resampling is then a sparse matrix-vector product that
+// reads contiguous memory, done 4 pixels at a time with vector types.
+
+// Key footprints are in quarter key units. The keyboard is 22.5 units
+// wide, which is squeezed into the 88 columns of the raster.
+#define RV_RASTER_UNITS_W  90
+#define RV_RASTER_ROW_H    (RV_RASTER_H / RV_NUM_ROWS)
+#define RV_RASTER_MAX_SPANS (RV_NUM_KEYS * 2 * RV_RASTER_ROW_H + RV_NUM_KEYS)
+#define RV_RASTER_MAX_WEIGHTS (RV_RASTER_MAX_SPANS * 16)
+
+typedef float rv_v4f __attribute__((vector_size(16)));
+
+typedef struct rv_raster_span_type {
+	unsigned short offset;  // Of the first pixel
+	unsigned short len;     // Padded to a multiple of 4
+	unsigned int weights;   // Index of the first weight
+} rv_raster_span;
+
+// Keys that are not 1x1, and keys that start a block. x is where the key
+// starts, 0 if it follows the previous key in its row.
+typedef struct rv_raster_shape_type {
+	unsigned short code;
+	unsigned char  w;       // 0 is 1 unit
+	unsigned char  x;
+	unsigned char  tall;    // Spans this row and the one below
+} rv_raster_shape;
+
+static const rv_raster_shape rv_raster_shapes_common[] = {
+	{ KEY_F1,        0,  8, 0 }, { KEY_F5,       0, 26, 0 }, { KEY_F9,    0, 44, 0 },
+	{ KEY_SYSRQ,     0, 61, 0 }, { KEY_INSERT,   0, 61, 0 }, { KEY_DELETE, 0, 61, 0 },
+	{ KEY_UP,        0, 65, 0 }, { KEY_LEFT,     0, 61, 0 },
+	{ KEY_NUMLOCK,   0, 74, 0 }, { KEY_KP7,      0, 74, 0 }, { KEY_KP4,   0, 74, 0 },
+	{ KEY_KP1,       0, 74, 0 }, { KEY_KP0,      8, 74, 0 },
+	{ KEY_KPPLUS,    0,  0, 1 }, { KEY_KPENTER,  0,  0, 1 },
+	{ KEY_BACKSPACE, 8,  0, 0 }, { KEY_TAB,      6,  0, 0 }, { KEY_CAPSLOCK, 7, 0, 0 },
+	{ KEY_RIGHTSHIFT, 11, 0, 0 },
+	{ KEY_LEFTCTRL,  5,  0, 0 }, { KEY_LEFTMETA, 5,  0, 0 }, { KEY_LEFTALT,  5, 0, 0 },
+	{ KEY_SPACE,    25,  0, 0 }, { KEY_RIGHTALT, 5,  0, 0 }, { KEY_FN,       5, 0, 0 },
+	{ KEY_COMPOSE,   5,  0, 0 }, { KEY_RIGHTCTRL, 5, 0, 0 },
+	{ 0 }
+};
+
+static const rv_raster_shape rv_raster_shapes_iso[] = {
+	{ KEY_ENTER, 6, 0, 1 }, { KEY_LEFTSHIFT, 5, 0, 0 },
+	{ 0 }
+};
+
+static const rv_raster_shape rv_raster_shapes_ansi[] = {
+	{ KEY_ENTER, 9, 0, 0 }, { KEY_BACKSLASH, 6, 0, 0 }, { KEY_LEFTSHIFT, 9, 0, 0 },
+	{ 0 }
+};
+
+static rv_raster_span rv_raster_spans[RV_RASTER_MAX_SPANS];
+static unsigned short rv_raster_key_spans[RV_NUM_KEYS + 1];
+static float rv_raster_weights[RV_RASTER_MAX_WEIGHTS] __attribute__((aligned(16)));
+static unsigned char rv_raster_key_x[RV_NUM_KEYS];
+static unsigned char rv_raster_key_y[RV_NUM_KEYS];
+
+static const rv_raster_shape *rv_raster_find_shape(const rv_raster_shape *shapes, int code) {
+	for (; shapes->code; shapes++) {
+		if (shapes->code == code) return shapes;
+	}
+	return NULL;
+}
+
+// Adds the spans of one key, covering [x0, x1) in pixels and whole rows
+// [y0, y1). Returns the next free weight.
+static unsigned int rv_raster_add_key(float x0, float x1, int y0, int y1, int *num_spans, unsigned int w) {
+	int first = (int)x0, last = (int)ceilf(x1) - 1;
+	int len = ((last - first + 1) + 3) & ~3;
+	float area = (x1 - x0) * (y1 - y0);
+	int x, y;
+
+	if (last >= RV_RASTER_W) last = RV_RASTER_W - 1;
+
+	for (y = y0; y < y1; y++) {
+		rv_raster_span *s;
+		if (*num_spans == RV_RASTER_MAX_SPANS || w + len > RV_RASTER_MAX_WEIGHTS) break;
+		s = &rv_raster_spans[(*num_spans)++];
+		s->offset  = y * RV_RASTER_W + first;
+		s->len     = len;
+		s->weights = w;
+		for (x = 0; x < len; x++) {
+			float left  = first + x, right = first + x + 1;
+			float cover = 0;
+			if (first + x <= last) {
+				if (left < x0)  left  = x0;
+				if (right > x1) right = x1;
+				cover = right > left ? right - left : 0;
+			}
+			rv_raster_weights[w++] = cover / area;
+		}
+	}
+
+	return w;
+}
+
+// Footprints of the keys of the current layout. Called by
+// rv_key_pos_init().
+void rv_raster_init() {
+	const rv_raster_shape *model_shapes = rv_topo_model == RV_TOPO_ISO ? rv_raster_shapes_iso : rv_raster_shapes_ansi;
+	unsigned short key_code[RV_NUM_KEYS];
+	int k_x0[RV_NUM_KEYS], k_x1[RV_NUM_KEYS], k_row[RV_NUM_KEYS], k_tall[RV_NUM_KEYS];
+	float scale = (float)RV_RASTER_W / RV_RASTER_UNITS_W;
+	int num_spans = 0;
+	unsigned int w = 0;
+	int code, row, i, k;
+
+	memset(key_code, 0, sizeof(key_code));
+	for (code = RV_MAX_EV_CODE; code > 0; code--) {
+		k = rv_ev2rv[rv_topo_model][code];
+		if (k != 0xff) key_code[k] = code;
+	}
+
+	for (k = 0; k < RV_NUM_KEYS; k++) k_row[k] = -1;
+
+	for (row = 0; row < RV_NUM_ROWS; row++) {
+		int x = 0;
+		for (i = 0; i < RV_MAX_KEYS_PER_ROW; i++) {
+			const rv_raster_shape *shape;
+			int width = 4, tall = 0;
+
+			k = rv_rows[rv_topo_model][row][i];
+			if (k == 0xff) break;
+
+			shape = rv_raster_find_shape(model_shapes, key_code[k]);
+			if (!shape) shape = rv_raster_find_shape(rv_raster_shapes_common, key_code[k]);
+			if (shape) {
+				if (shape->w) width = shape->w;
+				if (shape->x) x = shape->x;
+				tall = shape->tall;
+			}
+
+			k_x0[k] = x;
+			k_x1[k] = x + width;
+			k_row[k] = row;
+			k_tall[k] = tall;
+			x += width;
+		}
+	}
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		rv_raster_key_spans[k] = num_spans;
+		if (k_row[k] < 0) continue;
+		w = rv_raster_add_key(k_x0[k] * scale, k_x1[k] * scale,
+			k_row[k] * RV_RASTER_ROW_H, (k_row[k] + 1 + k_tall[k]) * RV_RASTER_ROW_H, &num_spans, w);
+		rv_raster_key_x[k] = (k_x0[k] + k_x1[k]) * scale / 2;
+		rv_raster_key_y[k] = k_row[k] * RV_RASTER_ROW_H + (1 + k_tall[k]) * RV_RASTER_ROW_H / 2;
+	}
+	rv_raster_key_spans[RV_NUM_KEYS] = num_spans;
+}
+
+void rv_raster_key_center(int k, int *x, int *y) {
+	*x = rv_raster_key_x[k];
+	*y = rv_raster_key_y[k];
+}
+
+// Colors of the keys, from the raster
+void rv_raster_resample(const rv_raster *ras, rv_rgb_map *map) {
+	int k, s, i;
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		rv_v4f r = { 0 }, g = { 0 }, b = { 0 };
+		float sr, sg, sb;
+
+		for (s = rv_raster_key_spans[k]; s < rv_raster_key_spans[k + 1]; s++) {
+			const rv_raster_span *span = &rv_raster_spans[s];
+			const float *w = &rv_raster_weights[span->weights];
+			for (i = 0; i < span->len; i += 4) {
+				rv_v4f wv, pr, pg, pb;
+				memcpy(&wv, w + i, sizeof(wv));
+				memcpy(&pr, &ras->r[span->offset + i], sizeof(pr));
+				memcpy(&pg, &ras->g[span->offset + i], sizeof(pg));
+				memcpy(&pb, &ras->b[span->offset + i], sizeof(pb));
+				r += wv * pr;
+				g += wv * pg;
+				b += wv * pb;
+			}
+		}
+
+		sr = r[0] + r[1] + r[2] + r[3];
+		sg = g[0] + g[1] + g[2] + g[3];
+		sb = b[0] + b[1] + b[2] + b[3];
+		map->key[k].r = (short)(sr + 0.5f);
+		map->key[k].g = (short)(sg + 0.5f);
+		map->key[k].b = (short)(sb + 0.5f);
+	}
+}
+
+// Plasma: sums of sine waves over the raster, through a color palette.
+// The waves are looked up in a table, the distance term is precomputed.
+void rv_fx_plasma() {
+	static rv_raster ras;
+	static unsigned char dist[RV_RASTER_H][RV_RASTER_W];
+	float sine[256];
+	rv_rgb pal[256];
+	rv_rgb_map map;
+	int x, y, i;
+
+	rv_key_pos_init();
+
+	for (i = 0; i < 256; i++) {
+		sine[i] = sinf(i * 2 * M_PI / 256);
+		pal[i].r = 128 + 127 * sinf(i * 2 * M_PI / 256);
+		pal[i].g = 128 + 127 * sinf(i * 2 * M_PI / 256 + 2 * M_PI / 3);
+		pal[i].b = 128 + 127 * sinf(i * 2 * M_PI / 256 + 4 * M_PI / 3);
+	}
+	for (y = 0; y < RV_RASTER_H; y++) {
+		for (x = 0; x < RV_RASTER_W; x++) {
+			dist[y][x] = (int)(sqrtf((x - RV_RASTER_W / 2) * (x - RV_RASTER_W / 2) + 4 * (y - RV_RASTER_H / 2) * (y - RV_RASTER_H / 2)) * 4) & 0xff;
+		}
+	}
+
+	while (1) {
+		unsigned int t = rv_clock_usec() / 15625;   // 64 steps per second
+
+		for (y = 0; y < RV_RASTER_H; y++) {
+			float row = sine[(y * 8 + t) & 0xff];
+			for (x = 0; x < RV_RASTER_W; x++) {
+				float v = sine[(x * 4 + t * 2) & 0xff] + row + sine[(x * 2 + y * 6 + t) & 0xff] + sine[(dist[y][x] + t * 3) & 0xff];
+				const rv_rgb *c = &pal[(int)(v * 32 + 128) & 0xff];
+				ras.r[y * RV_RASTER_W + x] = c->r;
+				ras.g[y * RV_RASTER_W + x] = c->g;
+				ras.b[y * RV_RASTER_W + x] = c->b;
+			}
+		}
+
+		rv_raster_resample(&ras, &map);
+		rv_ctl_poll();
+		rv_send_led_map(&map);
+
+		if (rv_frame_end()) break;
+	}
+}
+
+// Fire: heat rises from the bottom row, spreads and cools, and is shown
+// through a black, red, yellow, white palette. Key presses stoke it below
+// the key.
+#define RV_FIRE_COOLING 10
+#define RV_FIRE_STOKE   192
+
+void rv_fx_fire() {
+	static rv_raster ras;
+	static unsigned char heat[RV_RASTER_H + 1][RV_RASTER_W];
+	rv_rgb pal[256];
+	rv_rgb_map map;
+	rv_key_event kev;
+	int input, x, y, i;
+
+	rv_key_pos_init();
+	input = rv_init_evdev(0) == RV_SUCCESS;
+
+	for (i = 0; i < 256; i++) {
+		pal[i].r = i < 85 ? i * 3 : 255;
+		pal[i].g = i < 85 ? 0 : i < 170 ? (i - 85) * 3 : 255;
+		pal[i].b = i < 170 ? 0 : (i - 170) * 3;
+	}
+	memset(heat, 0, sizeof(heat));
+
+	while (1) {
+		// A hidden row below the raster feeds the flames
+		for (x = 0; x < RV_RASTER_W; x++) heat[RV_RASTER_H][x] = 128 + (rv_rand() >> 25);
+
+		if (input) {
+			rv_update_evdev();
+			while (rv_next_key_event(&kev)) {
+				int kx, ky;
+				if (kev.value != RV_KEY_PRESSED) continue;
+				rv_raster_key_center(kev.key, &kx, &ky);
+				ky = ky + 2 < RV_RASTER_H ? ky + 2 : RV_RASTER_H;
+				for (x = kx - 2; x <= kx + 2; x++) {
+					if (x < 0 || x >= RV_RASTER_W) continue;
+					heat[ky][x] = heat[ky][x] + RV_FIRE_STOKE > 255 ? 255 : heat[ky][x] + RV_FIRE_STOKE;
+				}
+			}
+		}
+
+		for (y = 0; y < RV_RASTER_H; y++) {
+			for (x = 0; x < RV_RASTER_W; x++) {
+				int l = heat[y + 1][x > 0 ? x - 1 : x];
+				int r = heat[y + 1][x < RV_RASTER_W - 1 ? x + 1 : x];
+				int v = (l + r + 2 * heat[y + 1][x] + 2 * heat[y][x]) / 6 - (rv_rand() >> 24) % RV_FIRE_COOLING;
+				heat[y][x] = v < 0 ? 0 : v;
+			}
+		}
+
+		for (y = 0; y < RV_RASTER_H; y++) {
+			for (x = 0; x < RV_RASTER_W; x++) {
+				const rv_rgb *c = &pal[heat[y][x]];
+				ras.r[y * RV_RASTER_W + x] = c->r;
+				ras.g[y * RV_RASTER_W + x] = c->g;
+				ras.b[y * RV_RASTER_W + x] = c->b;
+			}
+		}
+
+		rv_raster_resample(&ras, &map);
+		rv_ctl_poll();
+		rv_send_led_map(&map);
+
+		if (rv_frame_end()) break;
+	}
+}
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include "roccat-vulcan.h"
+
+// Record and replay of key events, so effects can be run on the same
+// input again, e.g. for regression tests against the LED reports written
+// by the mock transport (-o), or for repeatable benchmarks.
+//
+// Events are recorded with the frame in which the effect took them. On
+// replay, they are handed to the effect in the same frame, and time as
+// seen by the effects is a virtual clock that advances by one frame time
+// per frame. Together with the RNG seed from the recording, this makes
+// the output of a replay the same on every run.
+//
+// The file is a header followed by fixed size records, in host byte
+// order. A record with key RV_REC_END marks the frame the recording
+// stopped in.
+
+#define RV_REC_MAGIC 0x52564b31   // "RVK1"
+#define RV_REC_END   0xff
+
+typedef struct rv_rec_header_type {
+	uint32_t magic;
+	uint32_t seed;
+	uint32_t frame_us;
+	uint32_t topo_model;
+} rv_rec_header;
+
+typedef struct rv_rec_event_type {
+	uint32_t frame;
+	uint16_t offset_us;     // Since the start of the frame
+	uint8_t  key;
+	uint8_t  value;
+} rv_rec_event;
+
+int rv_replay_fast = 0;
+
+static uint32_t rv_frame = 0;
+static uint64_t rv_frame_start = 0;
+static FILE *rv_rec_out = NULL;
+static FILE *rv_replay_in = NULL;
+static rv_rec_event rv_replay_pending;
+static int rv_replay_have_pending = 0;
+static uint32_t rv_rand_state = 1;
+static volatile sig_atomic_t rv_rec_stop = 0;
+
+static uint64_t rv_clock_real() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Time as seen by the effects, in microseconds. Virtual while replaying.
+uint64_t rv_clock_usec() {
+	if (rv_replay_in) return (uint64_t)rv_frame * rv_frame_us;
+	return rv_clock_real();
+}
+
+// Called once per frame, by rv_frame_end()
+void rv_clock_tick() {
+	rv_frame++;
+	if (!rv_rec_out) return;
+
+	// Stop between two frames, so the end of the recording is written
+	if (rv_rec_stop) exit(RV_SUCCESS);
+	rv_frame_start = rv_clock_real();
+}
+
+void rv_rand_seed(uint32_t seed) {
+	// xorshift must not start at zero
+	rv_rand_state = seed ? seed : 0x9e3779b9;
+}
+
+uint32_t rv_rand() {
+	uint32_t x = rv_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return rv_rand_state = x;
+}
+
+static void rv_record_close() {
+	rv_rec_event rec = { .frame = rv_frame, .key = RV_REC_END };
+
+	if (!rv_rec_out) return;
+	fwrite(&rec, sizeof(rec), 1, rv_rec_out);
+	fclose(rv_rec_out);
+	rv_rec_out = NULL;
+}
+
+static void rv_record_stop(int sig) {
+	(void)sig;
+	// A second signal ends it right away
+	if (rv_rec_stop) _exit(RV_FAILURE);
+	rv_rec_stop = 1;
+}
+
+int rv_record_open(const char *file_name, uint32_t seed) {
+	rv_rec_header hdr = { RV_REC_MAGIC, seed, rv_frame_us, rv_topo_model };
+
+	rv_rec_out = fopen(file_name, "wb");
+	if (!rv_rec_out) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to create '%s': %s\n", file_name, strerror(errno));
+		return RV_FAILURE;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, rv_rec_out) != 1) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to write '%s'\n", file_name);
+		fclose(rv_rec_out);
+		rv_rec_out = NULL;
+		return RV_FAILURE;
+	}
+	rv_frame_start = rv_clock_real();
+	atexit(rv_record_close);
+	signal(SIGINT, rv_record_stop);
+	signal(SIGTERM, rv_record_stop);
+
+	rv_printf(RV_LOG_NORMAL, "Recording key events to '%s'\n", file_name);
+	return RV_SUCCESS;
+}
+
+void rv_record_event(const rv_key_event *kev) {
+	rv_rec_event rec = { .frame = rv_frame, .key = kev->key, .value = kev->value };
+	uint64_t offset;
+
+	if (!rv_rec_out) return;
+	offset = kev->usec > rv_frame_start ? kev->usec - rv_frame_start : 0;
+	rec.offset_us = offset > 0xffff ? 0xffff : offset;
+	fwrite(&rec, sizeof(rec), 1, rv_rec_out);
+}
+
+// Takes the layout and frame time from the recording. The seed is only
+// taken if 'seed' is not NULL.
+int rv_replay_open(const char *file_name, uint32_t *seed) {
+	rv_rec_header hdr;
+
+	rv_replay_in = fopen(file_name, "rb");
+	if (!rv_replay_in) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to open '%s': %s\n", file_name, strerror(errno));
+		return RV_FAILURE;
+	}
+	if (fread(&hdr, sizeof(hdr), 1, rv_replay_in) != 1 || hdr.magic != RV_REC_MAGIC ||
+	    hdr.topo_model >= RV_NUM_TOPO_MODELS || !hdr.frame_us) {
+		rv_printf(RV_LOG_NORMAL, "Error: '%s' is not a key event recording\n", file_name);
+		fclose(rv_replay_in);
+		rv_replay_in = NULL;
+		return RV_FAILURE;
+	}
+
+	rv_topo_model = hdr.topo_model;
+	rv_frame_us   = hdr.frame_us;
+	if (seed) *seed = hdr.seed;
+
+	rv_printf(RV_LOG_NORMAL, "Replaying key events from '%s'%s\n", file_name, rv_replay_fast ? " as fast as possible" : "");
+	return RV_SUCCESS;
+}
+
+int rv_replay_active() {
+	return rv_replay_in != NULL;
+}
+
+// Next recorded event that is due in the current frame. Exits when the
+// recording is over.
+int rv_replay_next(rv_key_event *kev) {
+	if (!rv_replay_have_pending) {
+		if (fread(&rv_replay_pending, sizeof(rv_replay_pending), 1, rv_replay_in) != 1) {
+			rv_replay_pending.frame = rv_frame;
+			rv_replay_pending.key   = RV_REC_END;
+		}
+		rv_replay_have_pending = 1;
+	}
+
+	if (rv_replay_pending.frame > rv_frame) return 0;
+
+	if (rv_replay_pending.key == RV_REC_END) {
+		rv_printf(RV_LOG_NORMAL, "Replay finished after %u frames\n", rv_frame);
+		exit(RV_SUCCESS);
+	}
+	if (rv_replay_pending.key >= RV_NUM_KEYS || rv_replay_pending.value > RV_KEY_REPEATED) {
+		rv_printf(RV_LOG_NORMAL, "Error: Invalid key event in recording, frame %u\n", rv_replay_pending.frame);
+		exit(RV_FAILURE);
+	}
+
+	kev->usec  = (uint64_t)rv_frame * rv_frame_us + rv_replay_pending.offset_us;
+	kev->key   = rv_replay_pending.key;
+	kev->value = rv_replay_pending.value;
+	rv_replay_have_pending = 0;
+	return 1;
+}
@@ -3,12 +3,15 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 
 #include "roccat-vulcan.h"
 
 #define FX_MODE_IMPACT 0
 #define FX_MODE_PIPED 1
+#define FX_MODE_SHADER 2
+#define FX_MODE_AUDIO 3
 
 // Globals
 uint16_t rv_products[3]   = { 0x3098, 0x307a,  0x0000 };
@@ -41,10 +44,34 @@ char * rv_colors_desc[RV_NUM_COLORS] = {
 
 int rv_topo_model = RV_TOPO_ISO;
 
-rv_rgb* rv_fixed[RV_NUM_KEYS];
+// Fixed key colors. Keys in the mask show their color from the plane
+// instead of the effect.
+rv_rgb_map rv_fixed;
+rv_keyset rv_fixed_mask;
 
 rv_rgb rv_color_off = { .r = 0x0000, .g = 0x0000, .b = 0x0000 };
 
+// Output correction, applied through lookup tables (hid.c)
+float rv_gamma = 1.0;
+rv_rgb rv_white = { .r = 0x00ff, .g = 0x00ff, .b = 0x00ff };
+int rv_brightness = 100;
+int rv_dither = 0;
+
+// Send the whole init sequence, even if the keyboard is already set up
+int rv_force_init = 0;
+
+// Frame time of the host-driven effects, ~30fps
+int rv_frame_us = 30000;
+
+// Built-in effect selected with -e or from the config file
+int rv_effect = RV_EFFECT_IMPACT;
+
+// Held keys pulse in the impact effect, about four times a second
+int rv_impact_repeat = RV_REPEAT_PULSE;
+
+// Cap of the sparks effect
+int rv_particles_max = 1024;
+
 void show_usage(const char *arg0) {
 	rv_printf(RV_LOG_NORMAL, "\n");
 	rv_printf(RV_LOG_NORMAL, "By default, %s plays 'impact' effect. In this mode, effect colors can\n", arg0);
@@ -60,6 +87,36 @@ void show_usage(const char *arg0) {
 	rv_printf(RV_LOG_NORMAL, "-k [keyName:r,g,b] : Set the key with 'keyName' to a static color. Keynames\n");
 	rv_printf(RV_LOG_NORMAL, "                     are evdev KEY_* constants. RGB values should be in the\n");
 	rv_printf(RV_LOG_NORMAL, "                     effective range of 0..255.\n");
+	rv_printf(RV_LOG_NORMAL, "-g [gamma]         : Gamma correction of the LED output. Default is 1.0 (off),\n");
+	rv_printf(RV_LOG_NORMAL, "                     try 2.2 for perceptually even fades.\n");
+	rv_printf(RV_LOG_NORMAL, "-W [r,g,b]         : White point. Scales each channel, in the range of 0..255.\n");
+	rv_printf(RV_LOG_NORMAL, "                     Default is 255,255,255.\n");
+	rv_printf(RV_LOG_NORMAL, "-l [brightness]    : Global brightness in percent (0..100). Default is 100.\n");
+	rv_printf(RV_LOG_NORMAL, "-d                 : Temporal dithering. Smooths slow and dark fades by spreading\n");
+	rv_printf(RV_LOG_NORMAL, "                     levels between two brightness steps over several frames.\n");
+	rv_printf(RV_LOG_NORMAL, "                     Only has an effect with -g, -W or -l.\n");
+	rv_printf(RV_LOG_NORMAL, "-C [pipePath]      : Read control commands from a named pipe while an effect is\n");
+	rv_printf(RV_LOG_NORMAL, "                     running. Write brightness:percent to change the brightness,\n");
+	rv_printf(RV_LOG_NORMAL, "                     key:keyName:r,g,b or key:keyName:off to set a fixed color.\n");
+	rv_printf(RV_LOG_NORMAL, "-m [socketPath]    : Serve metrics in Prometheus text format on a unix socket, e.g.\n");
+	rv_printf(RV_LOG_NORMAL, "                     curl --unix-socket socketPath http://localhost/metrics\n");
+	rv_printf(RV_LOG_NORMAL, "-F                 : Always send the initialization sequence. By default, it is\n");
+	rv_printf(RV_LOG_NORMAL, "                     skipped if nothing changed since the last start.\n");
+	rv_printf(RV_LOG_NORMAL, "-f [configPath]    : Read settings from a config file. It is reloaded on SIGHUP\n");
+	rv_printf(RV_LOG_NORMAL, "                     or when it changes. Check the README.md for the format.\n");
+	rv_printf(RV_LOG_NORMAL, "-R [recordPath]    : Record key events to a file.\n");
+	rv_printf(RV_LOG_NORMAL, "-r [recordPath]    : Replay recorded key events instead of reading the keyboard.\n");
+	rv_printf(RV_LOG_NORMAL, "-N                 : Replay as fast as possible, not in real time.\n");
+	rv_printf(RV_LOG_NORMAL, "-S [seed]          : Seed for random effects (like ghost typing). Replays use\n");
+	rv_printf(RV_LOG_NORMAL, "                     the seed of the recording by default.\n");
+	rv_printf(RV_LOG_NORMAL, "-o [outPath]       : Write LED reports to a file instead of the keyboard.\n");
+	rv_printf(RV_LOG_NORMAL, "-U                 : Send LED data through libusb instead of the hidraw device.\n");
+	rv_printf(RV_LOG_NORMAL, "                     This detaches the LED interface from the kernel driver.\n");
+	rv_printf(RV_LOG_NORMAL, "-T [prio@cpu]      : Realtime frame scheduling. Frames are due at fixed times, and the\n");
+	rv_printf(RV_LOG_NORMAL, "                     render thread runs under SCHED_FIFO with priority 'prio' (1..99,\n");
+	rv_printf(RV_LOG_NORMAL, "                     0 keeps the normal class), pinned to 'cpu' if given, with its\n");
+	rv_printf(RV_LOG_NORMAL, "                     memory locked (with a priority). Needs CAP_SYS_NICE and\n");
+	rv_printf(RV_LOG_NORMAL, "                     CAP_IPC_LOCK.\n");
 	rv_printf(RV_LOG_NORMAL, "-v                 : Be verbose.\n");
 	rv_printf(RV_LOG_NORMAL, "\n");
 	rv_printf(RV_LOG_NORMAL, "-p [pipePath]      : Read commands from a named pipe. To set a key to a static color,\n");
@@ -68,9 +125,36 @@ void show_usage(const char *arg0) {
 	rv_printf(RV_LOG_NORMAL, "                     RGB values should be in the effective range of 0..255.\n");
 	rv_printf(RV_LOG_NORMAL, "                     Other command line options do not apply.\n");
 	rv_printf(RV_LOG_NORMAL, "\n");
+	rv_printf(RV_LOG_NORMAL, "-e [effect]        : Select a built-in effect. Supported effects are 'impact'\n");
+	rv_printf(RV_LOG_NORMAL, "                     (default), 'sysload' (CPU cores on the F-key row, memory\n");
+	rv_printf(RV_LOG_NORMAL, "                     on the number row, disk I/O on the numpad), 'plasma',\n");
+	rv_printf(RV_LOG_NORMAL, "                     'fire' (flames rise from pressed keys) and 'sparks'\n");
+	rv_printf(RV_LOG_NORMAL, "                     (pressed keys emit sparks that bounce around).\n");
+	rv_printf(RV_LOG_NORMAL, "-i [repeat]        : What held keys do in the 'impact' effect: 'ignore' (nothing),\n");
+	rv_printf(RV_LOG_NORMAL, "                     'pulse' (a new impact every few repeats, default) or\n");
+	rv_printf(RV_LOG_NORMAL, "                     'sustain' (the key stays lit while it is held).\n");
+	rv_printf(RV_LOG_NORMAL, "-n [count]         : Most sparks alive at once in the 'sparks' effect (1..%d,\n", RV_PARTICLES_MAX);
+	rv_printf(RV_LOG_NORMAL, "                     default 1024).\n");
+	rv_printf(RV_LOG_NORMAL, "\n");
+	rv_printf(RV_LOG_NORMAL, "-s [program]       : Play a per-key shader program, e.g. 'r = sin(t*2 + x*0.3)*127+128'.\n");
+	rv_printf(RV_LOG_NORMAL, "                     Inputs are t (seconds), k (key index), x/y (column/row),\n");
+	rv_printf(RV_LOG_NORMAL, "                     p (seconds since key was pressed) and d (neighbor distance\n");
+	rv_printf(RV_LOG_NORMAL, "                     from last pressed key), a (key is held) and h (number of\n");
+	rv_printf(RV_LOG_NORMAL, "                     held keys). Outputs are r, g and b.\n");
+	rv_printf(RV_LOG_NORMAL, "                     Check the README.md for more information.\n");
+	rv_printf(RV_LOG_NORMAL, "\n");
+	rv_printf(RV_LOG_NORMAL, "-a [pcmPath]       : Play an audio spectrum visualizer. Reads raw S16LE PCM (48kHz,\n");
+	rv_printf(RV_LOG_NORMAL, "                     stereo) or a 16-bit WAV file from a named pipe, a file or\n");
+	rv_printf(RV_LOG_NORMAL, "                     stdin ('-'). For example:\n");
+	rv_printf(RV_LOG_NORMAL, "                     parec --format=s16le --rate=48000 --channels=2 | %s -a -\n", arg0);
+	rv_printf(RV_LOG_NORMAL, "\n");
 	rv_printf(RV_LOG_NORMAL, "-w [speed]         : Set up 'wave' effect with desired speed (1-11) and quit.\n");
 	rv_printf(RV_LOG_NORMAL, "                     This effect is run by the hardware and does not require\n");
 	rv_printf(RV_LOG_NORMAL, "                     host support. Other command line options do not apply.\n");
+	rv_printf(RV_LOG_NORMAL, "-X [angle@x,y]     : Like -w, but with a custom sweep direction in degrees (0 is\n");
+	rv_printf(RV_LOG_NORMAL, "                     left to right, 90 is top to bottom). With an origin in key\n");
+	rv_printf(RV_LOG_NORMAL, "                     columns and rows, it runs outward from there. The speed is\n");
+	rv_printf(RV_LOG_NORMAL, "                     set with -w.\n");
 	rv_printf(RV_LOG_NORMAL, "\n");
 	exit(RV_FAILURE);
 }
@@ -87,14 +171,23 @@ int main(int argc, char* argv[])
 	void (*topo_func)();
 	int fx_mode = FX_MODE_IMPACT;
 	char *file_name;
+	char *shader_src = NULL;
+	char *ctl_name = NULL;
+	char *metrics_name = NULL;
+	char *config_name = NULL;
+	char *record_name = NULL;
+	char *replay_name = NULL;
+	char *mock_name = NULL;
+	uint32_t seed = 0;
+	int seed_set = 0;
+	int effect;
+	rv_shader *shader;
 
 	setvbuf(stdout, NULL, _IONBF, 0);
 
-	memset(rv_fixed, 0, sizeof(rv_fixed));
-
 	rv_printf(RV_LOG_NORMAL, "ROCCAT Vulcan for Linux [github.com/duncanthrax/roccat-vulcan]\n");
 
-	while ((opt = getopt(argc, argv, "hvw:p:c:k:b:t:")) != -1) {
+	while ((opt = getopt(argc, argv, "hvw:X:p:c:k:b:t:s:a:e:i:n:g:W:l:C:dm:Ff:R:r:NS:o:UT:")) != -1) {
 		switch (opt) {
 			case 'h':
 				show_usage(argv[0]);
@@ -119,12 +212,8 @@ int main(int argc, char* argv[])
 				if (sscanf(optarg, "%m[^:]:%hd,%hd,%hd", &keyname, &(rgb.r), &(rgb.g), &(rgb.b)) == 4) {
 					int k = rv_get_keycode(keyname);
 					if (k >= 0) {
-						rv_fixed[k] = malloc(sizeof(rv_rgb));
-						if (!rv_fixed[k]) {
-							rv_printf(RV_LOG_NORMAL, "Error: Unable to allocate memory\n");
-							return -1;
-						}
-						memcpy(rv_fixed[k], &rgb, sizeof(rv_rgb));
+						rv_fixed.key[k] = rgb;
+						rv_keyset_add(&rv_fixed_mask, k);
 						rv_printf(RV_LOG_NORMAL, "Key %s set to fixed color %hd,%hd,%hd\n", keyname, rgb.r, rgb.g, rgb.b);
 					}
 					else {
@@ -146,6 +235,10 @@ int main(int argc, char* argv[])
 				}
 				else speed = 6;
 			break;
+			case 'X':
+				mode = RV_MODE_WAVE;
+				if (rv_hwfx_set_sweep(optarg) != RV_SUCCESS) show_usage(argv[0]);
+			break;
 			case 'b':
 				if (strcmp(optarg,"ansi") == 0) {
 					rv_topo_model = RV_TOPO_ANSI;
@@ -177,6 +270,64 @@ int main(int argc, char* argv[])
 					return -1;
 				};
 			break;
+			case 'g':
+				rv_gamma = atof(optarg);
+				if (rv_gamma < 0.1 || rv_gamma > 5.0) {
+					rv_printf(RV_LOG_NORMAL, "Error: Gamma must be in the range of 0.1..5.0\n");
+					return -1;
+				}
+			break;
+			case 'W':
+				if (sscanf(optarg, "%hd,%hd,%hd", &(rv_white.r), &(rv_white.g), &(rv_white.b)) != 3 ||
+				    rv_white.r < 0 || rv_white.r > 255 ||
+				    rv_white.g < 0 || rv_white.g > 255 ||
+				    rv_white.b < 0 || rv_white.b > 255) {
+					rv_printf(RV_LOG_NORMAL, "Error: Unable to parse white point (-W) argument\n");
+					show_usage(argv[0]);
+				}
+			break;
+			case 'l':
+				rv_brightness = atoi(optarg);
+				if (rv_brightness < 0)   rv_brightness = 0;
+				if (rv_brightness > 100) rv_brightness = 100;
+			break;
+			case 'C':
+				ctl_name = optarg;
+			break;
+			case 'd':
+				rv_dither = 1;
+			break;
+			case 'm':
+				metrics_name = optarg;
+			break;
+			case 'F':
+				rv_force_init = 1;
+			break;
+			case 'f':
+				config_name = optarg;
+			break;
+			case 'R':
+				record_name = optarg;
+			break;
+			case 'r':
+				replay_name = optarg;
+			break;
+			case 'N':
+				rv_replay_fast = 1;
+			break;
+			case 'S':
+				seed = strtoul(optarg, NULL, 0);
+				seed_set = 1;
+			break;
+			case 'o':
+				mock_name = optarg;
+			break;
+			case 'T':
+				if (rv_rt_parse(optarg) != RV_SUCCESS) show_usage(argv[0]);
+			break;
+			case 'U':
+				rv_led_libusb = 1;
+			break;
 			case 'v':
 				rv_verbose = 1;
 			break;
@@ -184,6 +335,33 @@ int main(int argc, char* argv[])
 				fx_mode = FX_MODE_PIPED;
 				file_name = optarg;
 			break;
+			case 's':
+				fx_mode = FX_MODE_SHADER;
+				shader_src = optarg;
+			break;
+			case 'a':
+				fx_mode = FX_MODE_AUDIO;
+				file_name = optarg;
+			break;
+			case 'e':
+				fx_mode = FX_MODE_IMPACT;
+				rv_effect = rv_get_effect(optarg);
+				if (rv_effect < 0) {
+					rv_printf(RV_LOG_NORMAL, "Error: Unknown effect '%s'\n", optarg);
+					return -1;
+				}
+			break;
+			case 'i':
+				rv_impact_repeat = rv_get_repeat_mode(optarg);
+				if (rv_impact_repeat < 0) {
+					rv_printf(RV_LOG_NORMAL, "Error: Unknown repeat mode '%s'\n", optarg);
+					return -1;
+				}
+			break;
+			case 'n':
+				rv_particles_max = atoi(optarg);
+				if (rv_particles_max < 1 || rv_particles_max > RV_PARTICLES_MAX) show_usage(argv[0]);
+			break;
 			default:
 				show_usage(argv[0]);
 		}
@@ -193,22 +371,29 @@ int main(int argc, char* argv[])
 		show_usage(argv[0]);
 	}
 
-	switch (mode) {
-		case RV_MODE_TOPO:
-			if (rv_open_device() < 0) {
-				rv_printf(RV_LOG_NORMAL, "Error: Unable to find keyboard\n");
-				return RV_FAILURE;
-			}
+	if (!seed_set) seed = time(NULL) ^ getpid();
+	if (replay_name && rv_replay_open(replay_name, seed_set ? NULL : &seed) != RV_SUCCESS) return RV_FAILURE;
 
-			if (rv_send_init(RV_MODE_FX, -1)) {
-				rv_printf(RV_LOG_NORMAL, "Error: Failed to send initialization sequence.\n");
-				return RV_FAILURE;
-			}
+	// Before any other thread is started, see rv_config_open(). After the
+	// replay, so the config starts from the layout of the recording.
+	if (config_name && rv_config_open(config_name) != RV_SUCCESS) return RV_FAILURE;
+	rv_rand_seed(seed);
+	if (record_name && rv_record_open(record_name, seed) != RV_SUCCESS) return RV_FAILURE;
+	if (mock_name && rv_mock_open(mock_name) != RV_SUCCESS) return RV_FAILURE;
 
-			if (rv_fx_init() != 0) {
-				rv_printf(RV_LOG_NORMAL, "Error: Failed to initialize LEDs\n");
-				return RV_FAILURE;
-			};
+	// From here on, output is written by a background thread
+	if (rv_log_start() != RV_SUCCESS) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to start logging thread\n");
+		return RV_FAILURE;
+	}
+
+	rv_lut_init();
+	if (ctl_name && rv_ctl_open(ctl_name) != RV_SUCCESS) return RV_FAILURE;
+	if (metrics_name && rv_metrics_open(metrics_name) != RV_SUCCESS) return RV_FAILURE;
+
+	switch (mode) {
+		case RV_MODE_TOPO:
+			if (rv_bringup(1) != RV_SUCCESS) return RV_FAILURE;
 
 			(*topo_func)();
 
@@ -234,48 +419,50 @@ int main(int argc, char* argv[])
 				rv_printf(RV_LOG_NORMAL, "Command format: keyName:r,g,b\n");
 				rv_printf(RV_LOG_NORMAL, "Keynames are evdev KEY_* constants, or 'all'.\n");
 				rv_printf(RV_LOG_NORMAL, "RGB values should be in the effective range of 0..255.\n");
-				if (rv_open_device() < 0) {
-					rv_printf(RV_LOG_NORMAL, "Error: Unable to find keyboard\n");
-					return RV_FAILURE;
-				}
+				if (rv_bringup(0) != RV_SUCCESS) return RV_FAILURE;
 
-				if (rv_send_init(RV_MODE_FX, -1)) {
-					rv_printf(RV_LOG_NORMAL, "Error: Failed to send initialization sequence.\n");
-					return RV_FAILURE;
-				}
+				rv_fx_piped(file_name);
+			}
+			else if (fx_mode == FX_MODE_SHADER) {
+				shader = rv_shader_compile(shader_src);
+				if (!shader) return RV_FAILURE;
 
-				if (rv_fx_init() != 0) {
-					rv_printf(RV_LOG_NORMAL, "Error: Failed to initialize LEDs\n");
-					return RV_FAILURE;
-				};
+				if (rv_bringup(0) != RV_SUCCESS) return RV_FAILURE;
+				if (rv_rt_start() != RV_SUCCESS) return RV_FAILURE;
 
-				rv_fx_piped(file_name);
+				rv_fx_shader(shader);
+			}
+			else if (fx_mode == FX_MODE_AUDIO) {
+				if (rv_bringup(RV_BRINGUP_NO_EVDEV) != RV_SUCCESS) return RV_FAILURE;
+
+				rv_fx_audio(file_name);
 			}
 			else {
-				rv_printf(RV_LOG_NORMAL, "Effect Color Table (change these with -c option)\n");
-				rv_printf(RV_LOG_NORMAL, "colorIdx    R      G      B  Desc\n");
-				rv_printf(RV_LOG_NORMAL, "------------------------------------------------\n");
+				if (rv_effect == RV_EFFECT_IMPACT) {
+					rv_printf(RV_LOG_NORMAL, "Effect Color Table (change these with -c option)\n");
+					rv_printf(RV_LOG_NORMAL, "colorIdx    R      G      B  Desc\n");
+					rv_printf(RV_LOG_NORMAL, "------------------------------------------------\n");
 
-				for (i = 0; i < RV_NUM_COLORS; i++) {
-					rv_printf(RV_LOG_NORMAL, "%d     % 7hd% 7hd% 7hd  %s\n", i, rv_colors[i].r, rv_colors[i].g, rv_colors[i].b, rv_colors_desc[i]);
+					for (i = 0; i < RV_NUM_COLORS; i++) {
+						rv_printf(RV_LOG_NORMAL, "%d     % 7hd% 7hd% 7hd  %s\n", i, rv_colors[i].r, rv_colors[i].g, rv_colors[i].b, rv_colors_desc[i]);
+					}
 				}
 
-				if (rv_open_device() < 0) {
-					rv_printf(RV_LOG_NORMAL, "Error: Unable to find keyboard\n");
-					return RV_FAILURE;
-				}
+				// Effects that read keys
+				if (rv_bringup(rv_effect == RV_EFFECT_IMPACT || rv_effect == RV_EFFECT_FIRE || rv_effect == RV_EFFECT_SPARKS ? 0 : RV_BRINGUP_NO_EVDEV) != RV_SUCCESS) return RV_FAILURE;
+				if (rv_rt_start() != RV_SUCCESS) return RV_FAILURE;
 
-				if (rv_send_init(RV_MODE_FX, -1)) {
-					rv_printf(RV_LOG_NORMAL, "Error: Failed to send initialization sequence.\n");
-					return RV_FAILURE;
+				// Effects return when a reloaded config selects another one
+				while (1) {
+					effect = rv_effect;
+					if      (effect == RV_EFFECT_SYSLOAD) rv_fx_sysload();
+					else if (effect == RV_EFFECT_PLASMA)  rv_fx_plasma();
+					else if (effect == RV_EFFECT_FIRE)    rv_fx_fire();
+					else if (effect == RV_EFFECT_SPARKS)  rv_fx_sparks();
+					else rv_fx_impact();
+					if (rv_effect == effect) return RV_FAILURE;
+					rv_printf(RV_LOG_NORMAL, "Switching to effect '%s'\n", rv_effect_names[rv_effect]);
 				}
-
-				if (rv_fx_init() != 0) {
-					rv_printf(RV_LOG_NORMAL, "Error: Failed to initialize LEDs\n");
-					return RV_FAILURE;
-				};
-
-				rv_fx_impact();
 			}
 		break;
 
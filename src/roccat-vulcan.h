@@ -6,8 +6,8 @@
 #define RV_VENDOR   0x1e7d
 #define RV_VENDOR_STR  "1e7d"
 
-#define RV_INPUT_DEV_DIR "/sys/class/input"
-#define RV_INPUT_DEV_PREFIX "event"
+#define RV_INPUT_SUBSYSTEM "input"
+#define RV_INPUT_SYSNAME "event*"
 
 #define RV_SUCCESS 0
 #define RV_FAILURE -1
@@ -26,7 +26,15 @@
 
 #define RV_MAX_EV_CODE 0x2ff
 
-#define RV_MAX_CONCURRENT_KEYS 10
+// Key events queued between two frames (power of two)
+#define RV_KEY_QUEUE_LENGTH 256
+
+// Topology table dimensions (fx.c)
+#define RV_NUM_ROWS 6
+#define RV_MAX_KEYS_PER_ROW 22
+#define RV_NUM_COLS 21
+#define RV_MAX_KEYS_PER_COL 6
+#define RV_MAX_NEIGH 10
 
 
 // These ones we know about. There might be more.
@@ -47,6 +55,31 @@ typedef struct rv_rgb_map_type {
     rv_rgb key[RV_NUM_KEYS];
 } rv_rgb_map;
 
+// One bit per key, for key state and masks
+#define RV_KEYSET_WORDS ((RV_NUM_KEYS + 63) / 64)
+typedef struct rv_keyset_type {
+    uint64_t w[RV_KEYSET_WORDS];
+} rv_keyset;
+
+static inline void rv_keyset_add(rv_keyset *s, int k) { s->w[k >> 6] |= 1ULL << (k & 63); }
+static inline void rv_keyset_del(rv_keyset *s, int k) { s->w[k >> 6] &= ~(1ULL << (k & 63)); }
+static inline int rv_keyset_has(const rv_keyset *s, int k) { return (s->w[k >> 6] >> (k & 63)) & 1; }
+
+static inline int rv_keyset_count(const rv_keyset *s) {
+    return __builtin_popcountll(s->w[0]) + __builtin_popcountll(s->w[1]) + __builtin_popcountll(s->w[2]);
+}
+
+// All keys of 'chord' are in 's'
+static inline int rv_keyset_all(const rv_keyset *s, const rv_keyset *chord) {
+    return ((chord->w[0] & ~s->w[0]) | (chord->w[1] & ~s->w[1]) | (chord->w[2] & ~s->w[2])) == 0;
+}
+
+// Keys in 'a' but not in 'b', e.g. keys that went down since the last frame
+static inline rv_keyset rv_keyset_minus(const rv_keyset *a, const rv_keyset *b) {
+    rv_keyset d = {{ a->w[0] & ~b->w[0], a->w[1] & ~b->w[1], a->w[2] & ~b->w[2] }};
+    return d;
+}
+
 #define RV_NUM_COLORS 10
 extern rv_rgb rv_colors[RV_NUM_COLORS];
 extern rv_rgb rv_color_off;
@@ -55,38 +88,201 @@ extern rv_rgb rv_color_off;
 extern int rv_verbose;
 extern uint16_t rv_products[3];
 extern char * rv_products_str[3];
-extern rv_rgb* rv_fixed[RV_NUM_KEYS];
+extern rv_rgb_map rv_fixed;
+extern rv_keyset rv_fixed_mask;
+extern float rv_gamma;
+extern rv_rgb rv_white;
+extern int rv_brightness;
+extern int rv_dither;
+extern int rv_force_init;
+extern int rv_frame_us;
+
+#define RV_EFFECT_IMPACT  0
+#define RV_EFFECT_SYSLOAD 1
+#define RV_EFFECT_PLASMA  2
+#define RV_EFFECT_FIRE    3
+#define RV_EFFECT_SPARKS  4
+#define RV_NUM_EFFECTS    5
+extern int rv_effect;
+extern const char *rv_effect_names[RV_NUM_EFFECTS];
+
+// What key repeats do in the impact effect
+#define RV_REPEAT_IGNORE  0
+#define RV_REPEAT_PULSE   1
+#define RV_REPEAT_SUSTAIN 2
+extern int rv_impact_repeat;
+
+// Particles alive at once in the sparks effect (particles.c)
+#define RV_PARTICLES_MAX 4096
+extern int rv_particles_max;
 
 // HID I/O functions (hid.c)
+struct udev;
+struct udev *rv_udev_acquire();
+void rv_udev_release();
 int rv_open_device();
+int rv_open_led_device();
+void rv_close_led_device();
+int rv_open_ctrl_device();
 int rv_wait_for_ctrl_device();
 int rv_get_ctrl_report(unsigned char report_id);
+int rv_build_ctrl_report(unsigned char report_id, int mode, int byteopt, unsigned char *out);
 int rv_set_ctrl_report(unsigned char report_id, int mode, int byteopt);
-int rv_send_led_map(rv_rgb_map *map);
+int rv_send_led_map(const rv_rgb_map *map);
 int rv_send_init(int type, int opt);
+void rv_lut_init();
+int rv_mock_open(const char *file_name);
+extern int rv_led_libusb;
+
+// Effects played by the keyboard (hwfx.c)
+#define RV_HWFX_HOST 0x06
+#define RV_HWFX_WAVE 0x0a
+int rv_hwfx_set_sweep(const char *spec);
+int rv_hwfx_build_report(int mode, int speed, unsigned char *out);
+
+// Device bring-up (bringup.c)
+#define RV_BRINGUP_NO_EVDEV -1
+int rv_bringup(int evdev_grab);
+
+// Control channel (ctl.c)
+int rv_ctl_open(const char *pipe_name);
+int rv_ctl_exec(char *line);
+void rv_ctl_poll();
+void rv_ctl_merge_fixed();
+void rv_ctl_remap(int from_topo_model);
+
+// Configuration file (config.c)
+int rv_config_open(char *config_name);
+int rv_config_poll();
 
 // Logging I/O functions (output.c)
 void rv_print_buffer(unsigned char *buffer, int len);
 void rv_printf(int verbose, const char *format, ...);
+void rv_log_event(int type, int code, int value);
+int rv_log_start();
+void rv_log_end();
+
+// Metrics endpoint (metrics.c)
+#define RV_METRIC_USB_BUCKETS 8
+#define RV_METRIC_FRAME_BUCKETS 8
+enum rv_metric_ids {
+	RV_METRIC_FRAMES_RENDERED,
+	RV_METRIC_FRAMES_SENT,
+	RV_METRIC_FRAMES_SKIPPED,
+	RV_METRIC_USB_ERRORS,
+	RV_METRIC_EVDEV_EVENTS,
+	RV_METRIC_DROPPED_KEYS,
+	RV_METRIC_SYN_DROPPED,
+	RV_METRIC_PIPE_PARSED,
+	RV_METRIC_PIPE_REJECTED,
+	RV_METRIC_CTL_PARSED,
+	RV_METRIC_CTL_REJECTED,
+	RV_METRIC_KEYS_HELD,
+	RV_METRIC_DEADLINE_MISSES,
+	RV_METRIC_PARTICLES,
+	RV_METRIC_PARTICLES_MAX,
+	RV_METRIC_PARTICLES_DROPPED,
+	// Histogram buckets, the last one is +Inf
+	RV_METRIC_USB_LATENCY,
+	RV_METRIC_USB_LATENCY_SUM = RV_METRIC_USB_LATENCY + RV_METRIC_USB_BUCKETS + 1,
+	RV_METRIC_FRAME_DELAY,
+	RV_METRIC_FRAME_DELAY_SUM = RV_METRIC_FRAME_DELAY + RV_METRIC_FRAME_BUCKETS + 1,
+	RV_NUM_METRICS
+};
+int rv_metrics_open(const char *socket_name);
+void rv_metric_add(int metric, uint64_t n);
+void rv_metric_set(int metric, uint64_t n);
+void rv_metric_usb_latency(uint64_t ns);
+void rv_metric_frame_delay(uint64_t ns);
 
 // Evdev
+#define RV_KEY_RELEASED 0
+#define RV_KEY_PRESSED  1
+#define RV_KEY_REPEATED 2
+
+typedef struct rv_key_event_type {
+	uint64_t usec;          // CLOCK_MONOTONIC, see rv_clock_usec()
+	unsigned char key;      // Vulcan key number
+	unsigned char value;    // RV_KEY_*
+} rv_key_event;
+
 int rv_init_evdev(int);
 int rv_update_evdev();
 int rv_get_keycode();
+int rv_get_keycode_for(const char *ev_keyname, int topo_model);
 int rv_get_evdev_keypress();
 const char *rv_get_ev_keyname();
-extern unsigned char rv_active_keys[RV_NUM_KEYS];
-extern unsigned char rv_released_keys[RV_MAX_CONCURRENT_KEYS];
-extern unsigned char rv_pressed_keys[RV_MAX_CONCURRENT_KEYS];
-extern unsigned char rv_repeated_keys[RV_MAX_CONCURRENT_KEYS];
+extern rv_keyset rv_keys_down;
+extern unsigned char rv_ev2rv[RV_NUM_TOPO_MODELS][RV_MAX_EV_CODE+1];
+int rv_next_key_event(rv_key_event *kev);
+void rv_reset_key_state();
+
+// Record and replay of key events (replay.c)
+extern int rv_replay_fast;
+uint64_t rv_clock_usec();
+void rv_clock_tick();
+void rv_rand_seed(uint32_t seed);
+uint32_t rv_rand();
+int rv_record_open(const char *file_name, uint32_t seed);
+int rv_replay_open(const char *file_name, uint32_t *seed);
+int rv_replay_active();
+int rv_replay_next(rv_key_event *kev);
+void rv_record_event(const rv_key_event *kev);
+
+// Frame pacing and realtime scheduling (rt.c)
+extern int rv_rt_priority;
+extern int rv_rt_cpu;
+int  rv_rt_parse(const char *spec);
+int  rv_rt_start();
+void rv_frame_wait();
 
 // FX functions (fx.c)
 int  rv_fx_init();
+int  rv_frame_end();
 void rv_fx_impact();
+int  rv_get_repeat_mode(const char *name);
+int  rv_get_effect(const char *name);
 void rv_fx_topo_rows();
 void rv_fx_topo_cols();
 void rv_fx_topo_keys();
 void rv_fx_topo_neigh();
 void rv_fx_piped(char *pipe_name);
+void rv_key_pos_init();
+void rv_blend_to(rv_rgb_map *src, rv_rgb_map *dst, rv_rgb tc, int amount);
+void rv_ease_to(rv_rgb_map *cur, rv_rgb_map *target, int amount);
+extern unsigned char rv_rows[RV_NUM_TOPO_MODELS][RV_NUM_ROWS][RV_MAX_KEYS_PER_ROW];
+extern unsigned char rv_cols[RV_NUM_TOPO_MODELS][RV_NUM_COLS][RV_MAX_KEYS_PER_COL];
+extern unsigned char rv_neigh[RV_NUM_TOPO_MODELS][RV_NUM_KEYS][RV_MAX_NEIGH];
+extern unsigned char rv_key_row[RV_NUM_KEYS];
+extern unsigned char rv_key_col[RV_NUM_KEYS];
+
+// System load meter effect (sysload.c)
+void rv_fx_sysload();
+
+// Raster effects (raster.c)
+#define RV_RASTER_W 88
+#define RV_RASTER_H 24
+typedef struct rv_raster_type {
+	// Planes are padded, spans are read 4 pixels at a time
+	float r[RV_RASTER_W * RV_RASTER_H + 4];
+	float g[RV_RASTER_W * RV_RASTER_H + 4];
+	float b[RV_RASTER_W * RV_RASTER_H + 4];
+} rv_raster;
+void rv_raster_init();
+void rv_raster_key_center(int k, int *x, int *y);
+void rv_raster_resample(const rv_raster *ras, rv_rgb_map *map);
+void rv_fx_plasma();
+void rv_fx_fire();
+
+// Particle effect (particles.c)
+void rv_fx_sparks();
+
+// Audio spectrum effect (audio.c)
+void rv_fx_audio(char *pcm_name);
+
+// Shader VM (shader.c)
+typedef struct rv_shader_type rv_shader;
+rv_shader *rv_shader_compile(const char *src);
+void rv_fx_shader(rv_shader *prog);
 
 #endif
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+
+#include "roccat-vulcan.h"
+
+// Frame pacing of the host-driven effects, and the realtime mode (-T).
+//
+// By default, effects sleep for one frame time after every frame, so the
+// frame period is the frame time plus the time the frame took. In
+// realtime mode, frames are due at fixed points in time, waited for with
+// clock_nanosleep(TIMER_ABSTIME). The render thread, which also writes
+// the LED reports, runs with the timer slack at its minimum, optionally
+// pinned to one CPU, and with a priority, under SCHED_FIFO with all
+// memory locked.
+//
+// In both modes, the delay between when a frame was due and when it
+// started is kept in a histogram, and frames that start more than half
+// a frame time late count as deadline misses.
+
+#define RV_RT_STACK_PREFAULT (256 * 1024)
+
+int rv_rt_priority = -1;     // -1 is off, 0 is realtime pacing without SCHED_FIFO
+int rv_rt_cpu = -1;
+
+static uint64_t rv_frame_due = 0;
+
+static uint64_t rv_rt_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// "prio[@cpu]"
+int rv_rt_parse(const char *spec) {
+	int prio, cpu = -1;
+
+	if (sscanf(spec, "%d@%d", &prio, &cpu) < 1) return RV_FAILURE;
+	if (prio < 0 || prio > 99) return RV_FAILURE;
+	if (strchr(spec, '@') && cpu < 0) return RV_FAILURE;
+
+	rv_rt_priority = prio;
+	rv_rt_cpu      = cpu;
+	return RV_SUCCESS;
+}
+
+// Touch the stack once, so pages it grows into later are already locked
+static void rv_rt_prefault_stack() {
+	volatile unsigned char stack[RV_RT_STACK_PREFAULT];
+	memset((unsigned char *)stack, 0, sizeof(stack));
+}
+
+// Called on the render thread, after bring-up and before the first
+// frame, so the threads started before keep their own scheduling.
+int rv_rt_start() {
+	struct sched_param param;
+	int err;
+
+	if (rv_rt_priority < 0) return RV_SUCCESS;
+
+	if (rv_rt_cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(rv_rt_cpu, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err) {
+			rv_printf(RV_LOG_NORMAL, "Error: Unable to pin the render thread to CPU %d: %s\n", rv_rt_cpu, strerror(err));
+			return RV_FAILURE;
+		}
+	}
+
+	// Wake up when due, not up to 50us later
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	if (rv_rt_priority > 0) {
+		// Locks the stacks of the other threads as well, which can be
+		// more than RLIMIT_MEMLOCK allows. Page faults only cost latency,
+		// so run without.
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+			rv_printf(RV_LOG_NORMAL, "Warning: Unable to lock memory: %s\n", strerror(errno));
+		}
+		else rv_rt_prefault_stack();
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rv_rt_priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err) {
+			rv_printf(RV_LOG_NORMAL, "Error: Unable to set realtime priority %d: %s\n", rv_rt_priority, strerror(err));
+			return RV_FAILURE;
+		}
+	}
+
+	if (rv_rt_cpu >= 0) rv_printf(RV_LOG_NORMAL, "Realtime frame scheduling, priority %d, on CPU %d\n", rv_rt_priority, rv_rt_cpu);
+	else                rv_printf(RV_LOG_NORMAL, "Realtime frame scheduling, priority %d\n", rv_rt_priority);
+	return RV_SUCCESS;
+}
+
+// Waits until the next frame is due. Called once per frame, by
+// rv_frame_end().
+void rv_frame_wait() {
+	uint64_t period = rv_frame_us * 1000ULL;
+	uint64_t now = rv_rt_now();
+	uint64_t delay;
+
+	if (rv_rt_priority < 0) {
+		rv_frame_due = now + period;
+		usleep(rv_frame_us);
+	}
+	else {
+		if (!rv_frame_due) rv_frame_due = now;
+		rv_frame_due += period;
+		if (now < rv_frame_due) {
+			struct timespec ts = { .tv_sec = rv_frame_due / 1000000000ULL, .tv_nsec = rv_frame_due % 1000000000ULL };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+		}
+	}
+
+	now = rv_rt_now();
+	delay = now > rv_frame_due ? now - rv_frame_due : 0;
+	rv_metric_frame_delay(delay);
+
+	if (delay > period / 2) rv_metric_add(RV_METRIC_DEADLINE_MISSES, 1);
+
+	// More than a frame behind, start over instead of rushing frames
+	if (delay > period) rv_frame_due = now;
+}
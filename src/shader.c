@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+
+#include "roccat-vulcan.h"
+
+// A tiny expression language for per-key effects, e.g.
+//
+//   r = sin(t*2 + x*0.3)*127+128; b = 255 - d*40
+//
+// Statements are 'name = expression', separated by ';' or newlines.
+// The program is compiled once into register bytecode. Every register
+// holds one float per key, so each instruction is executed as a tight
+// loop over all keys. Instructions that only depend on 't' and constants
+// are hoisted and run once per frame.
+
+#define RV_SHADER_REGS      64
+#define RV_SHADER_MAX_INSNS 256
+#define RV_SHADER_MAX_NAME  16
+
+// Time to report when a key has never been pressed (seconds)
+#define RV_SHADER_NEVER     1000.0f
+// Hop distance to report for keys not connected to the last pressed key
+#define RV_SHADER_FAR       99.0f
+
+// Fixed registers
+enum rv_shader_fixed_regs {
+	RV_REG_T,   // Time since effect start (seconds)
+	RV_REG_K,   // Key index (0..143)
+	RV_REG_X,   // Column number from rv_cols (0..20, -1 = n/a)
+	RV_REG_Y,   // Row number from rv_rows (0..5, -1 = n/a)
+	RV_REG_P,   // Time since this key was last pressed (seconds)
+	RV_REG_D,   // Neighbor hops from the last pressed key
+	RV_REG_A,   // This key is held down (0/1)
+	RV_REG_H,   // Number of keys held down
+	RV_REG_R,   // Output: red
+	RV_REG_G,   // Output: green
+	RV_REG_B,   // Output: blue
+	RV_NUM_FIXED_REGS
+};
+
+static const char *rv_shader_fixed_names[RV_NUM_FIXED_REGS] = {
+	"t", "k", "x", "y", "p", "d", "a", "h", "r", "g", "b"
+};
+
+enum rv_shader_ops {
+	RV_OP_MOV, RV_OP_NEG,
+	RV_OP_ADD, RV_OP_SUB, RV_OP_MUL, RV_OP_DIV, RV_OP_MOD,
+	RV_OP_LT,  RV_OP_GT,
+	RV_OP_SIN, RV_OP_COS, RV_OP_ABS, RV_OP_SQRT, RV_OP_EXP, RV_OP_FLOOR,
+	RV_OP_MIN, RV_OP_MAX, RV_OP_POW
+};
+
+static const struct {
+	const char *name;
+	int op;
+	int args;
+} rv_shader_funcs[] = {
+	{ "sin",   RV_OP_SIN,   1 },
+	{ "cos",   RV_OP_COS,   1 },
+	{ "abs",   RV_OP_ABS,   1 },
+	{ "sqrt",  RV_OP_SQRT,  1 },
+	{ "exp",   RV_OP_EXP,   1 },
+	{ "floor", RV_OP_FLOOR, 1 },
+	{ "min",   RV_OP_MIN,   2 },
+	{ "max",   RV_OP_MAX,   2 },
+	{ "pow",   RV_OP_POW,   2 },
+	{ NULL,    0,           0 }
+};
+
+typedef struct rv_shader_insn_type {
+	unsigned char op;
+	unsigned char dst;
+	unsigned char a;
+	unsigned char b;
+} rv_shader_insn;
+
+struct rv_shader_type {
+	// Per-frame program (once per frame) and per-key program (all keys)
+	rv_shader_insn uniform[RV_SHADER_MAX_INSNS];
+	rv_shader_insn varying[RV_SHADER_MAX_INSNS];
+	int num_uniform;
+	int num_varying;
+
+	// Uniform registers that need to be broadcast before the per-key program
+	unsigned char bcast[RV_SHADER_REGS];
+	int num_bcast;
+
+	float reg[RV_SHADER_REGS][RV_NUM_KEYS];
+};
+
+// Compiler state
+typedef struct rv_shader_cc_type {
+	rv_shader *prog;
+	const char *src;
+	const char *pos;
+	char names[RV_SHADER_REGS][RV_SHADER_MAX_NAME+1];
+	int num_named;            // Named/constant registers grow upwards
+	int temp;                 // Temporaries grow downwards
+	unsigned char is_const[RV_SHADER_REGS];
+	unsigned char is_uniform[RV_SHADER_REGS];
+	unsigned char is_bcast[RV_SHADER_REGS];
+	int error;
+} rv_shader_cc;
+
+static int rv_shader_expr(rv_shader_cc *cc);
+
+static void rv_shader_error(rv_shader_cc *cc, const char *msg) {
+	if (cc->error) return;
+	rv_printf(RV_LOG_NORMAL, "Error: Shader column %d: %s\n", (int)(cc->pos - cc->src) + 1, msg);
+	cc->error = 1;
+}
+
+static void rv_shader_skip_space(rv_shader_cc *cc) {
+	while (*cc->pos == ' ' || *cc->pos == '\t' || *cc->pos == '\r') cc->pos++;
+}
+
+static int rv_shader_peek(rv_shader_cc *cc) {
+	rv_shader_skip_space(cc);
+	return *cc->pos;
+}
+
+static int rv_shader_accept(rv_shader_cc *cc, char c) {
+	if (rv_shader_peek(cc) != c) return 0;
+	cc->pos++;
+	return 1;
+}
+
+static int rv_shader_ident(rv_shader_cc *cc, char *name) {
+	int len = 0;
+	rv_shader_skip_space(cc);
+	if (!isalpha((unsigned char)*cc->pos) && *cc->pos != '_') return 0;
+	while (isalnum((unsigned char)*cc->pos) || *cc->pos == '_') {
+		if (len == RV_SHADER_MAX_NAME) {
+			rv_shader_error(cc, "Identifier too long");
+			return 0;
+		}
+		name[len++] = *cc->pos++;
+	}
+	name[len] = 0;
+	return 1;
+}
+
+// Every assignment binds the name to a fresh register, so search the
+// most recent binding first.
+static int rv_shader_find(rv_shader_cc *cc, const char *name) {
+	int i;
+	for (i = cc->num_named - 1; i >= 0; i--) {
+		if (strcmp(cc->names[i], name) == 0) return i;
+	}
+	return -1;
+}
+
+static int rv_shader_alloc_named(rv_shader_cc *cc, const char *name) {
+	if (cc->num_named > cc->temp) {
+		rv_shader_error(cc, "Out of registers");
+		return 0;
+	}
+	strcpy(cc->names[cc->num_named], name);
+	return cc->num_named++;
+}
+
+static int rv_shader_alloc_temp(rv_shader_cc *cc) {
+	if (cc->temp < cc->num_named) {
+		rv_shader_error(cc, "Expression too complex");
+		return 0;
+	}
+	return cc->temp--;
+}
+
+static int rv_shader_const(rv_shader_cc *cc, float val) {
+	int r, k;
+	// Constants are stored in anonymous named registers, filled once here
+	for (r = RV_NUM_FIXED_REGS; r < cc->num_named; r++) {
+		if (cc->is_const[r] && cc->names[r][0] == 0 && cc->prog->reg[r][0] == val) return r;
+	}
+	r = rv_shader_alloc_named(cc, "");
+	if (cc->error) return 0;
+	for (k = 0; k < RV_NUM_KEYS; k++) cc->prog->reg[r][k] = val;
+	cc->is_const[r] = 1;
+	cc->is_uniform[r] = 1;
+	cc->is_bcast[r] = 1;
+	return r;
+}
+
+static float rv_shader_apply(int op, float a, float b) {
+	switch (op) {
+		case RV_OP_MOV:   return a;
+		case RV_OP_NEG:   return -a;
+		case RV_OP_ADD:   return a + b;
+		case RV_OP_SUB:   return a - b;
+		case RV_OP_MUL:   return a * b;
+		case RV_OP_DIV:   return b != 0.0f ? a / b : 0.0f;
+		case RV_OP_MOD:   return b != 0.0f ? fmodf(a, b) : 0.0f;
+		case RV_OP_LT:    return a < b;
+		case RV_OP_GT:    return a > b;
+		case RV_OP_SIN:   return sinf(a);
+		case RV_OP_COS:   return cosf(a);
+		case RV_OP_ABS:   return fabsf(a);
+		case RV_OP_SQRT:  return a > 0.0f ? sqrtf(a) : 0.0f;
+		case RV_OP_EXP:   return expf(a);
+		case RV_OP_FLOOR: return floorf(a);
+		case RV_OP_MIN:   return a < b ? a : b;
+		case RV_OP_MAX:   return a > b ? a : b;
+		case RV_OP_POW:   return powf(a, b);
+	}
+	return 0.0f;
+}
+
+static void rv_shader_mark_bcast(rv_shader_cc *cc, int r) {
+	if (cc->is_uniform[r] && !cc->is_bcast[r]) {
+		cc->prog->bcast[cc->prog->num_bcast++] = r;
+		cc->is_bcast[r] = 1;
+	}
+}
+
+// Emit an instruction into a fresh temporary, or into 'dst' if given.
+// Folds constants, and routes instructions with only uniform inputs to
+// the per-frame program.
+static int rv_shader_emit(rv_shader_cc *cc, int op, int a, int b, int dst) {
+	rv_shader *prog = cc->prog;
+	int uniform;
+	rv_shader_insn *insn;
+
+	if (cc->error) return 0;
+
+	if (dst < 0 && cc->is_const[a] && cc->is_const[b])
+		return rv_shader_const(cc, rv_shader_apply(op, prog->reg[a][0], prog->reg[b][0]));
+
+	uniform = cc->is_uniform[a] && cc->is_uniform[b] && dst != RV_REG_R && dst != RV_REG_G && dst != RV_REG_B;
+
+	// The per-frame program runs ahead of the per-key one, so its results
+	// must not land in temporaries that later statements reuse.
+	if (dst < 0) dst = uniform ? rv_shader_alloc_named(cc, "") : rv_shader_alloc_temp(cc);
+	if (cc->error) return 0;
+
+	if (uniform) {
+		if (prog->num_uniform == RV_SHADER_MAX_INSNS) goto TOO_LONG;
+		insn = &prog->uniform[prog->num_uniform++];
+	}
+	else {
+		if (prog->num_varying == RV_SHADER_MAX_INSNS) goto TOO_LONG;
+		rv_shader_mark_bcast(cc, a);
+		rv_shader_mark_bcast(cc, b);
+		insn = &prog->varying[prog->num_varying++];
+	}
+
+	insn->op  = op;
+	insn->dst = dst;
+	insn->a   = a;
+	insn->b   = b;
+	cc->is_const[dst]   = 0;
+	cc->is_uniform[dst] = uniform;
+	// A register that is written per frame must be broadcast again
+	cc->is_bcast[dst]   = 0;
+	return dst;
+
+	TOO_LONG:
+	rv_shader_error(cc, "Program too long");
+	return 0;
+}
+
+static int rv_shader_primary(rv_shader_cc *cc) {
+	char name[RV_SHADER_MAX_NAME+1];
+	int i, r, a, b;
+
+	rv_shader_skip_space(cc);
+
+	if (rv_shader_accept(cc, '(')) {
+		r = rv_shader_expr(cc);
+		if (!rv_shader_accept(cc, ')')) rv_shader_error(cc, "Expected ')'");
+		return r;
+	}
+
+	if (isdigit((unsigned char)*cc->pos) || *cc->pos == '.') {
+		char *end;
+		float val = strtof(cc->pos, &end);
+		cc->pos = end;
+		return rv_shader_const(cc, val);
+	}
+
+	if (rv_shader_ident(cc, name)) {
+		if (rv_shader_accept(cc, '(')) {
+			for (i = 0; rv_shader_funcs[i].name; i++) {
+				if (strcmp(rv_shader_funcs[i].name, name) == 0) break;
+			}
+			if (!rv_shader_funcs[i].name) {
+				rv_shader_error(cc, "Unknown function");
+				return 0;
+			}
+			a = b = rv_shader_expr(cc);
+			if (rv_shader_funcs[i].args == 2) {
+				if (!rv_shader_accept(cc, ',')) rv_shader_error(cc, "Expected ','");
+				b = rv_shader_expr(cc);
+			}
+			if (!rv_shader_accept(cc, ')')) rv_shader_error(cc, "Expected ')'");
+			return rv_shader_emit(cc, rv_shader_funcs[i].op, a, b, -1);
+		}
+		if (strcmp(name, "pi") == 0) return rv_shader_const(cc, (float)M_PI);
+		r = rv_shader_find(cc, name);
+		if (r < 0) rv_shader_error(cc, "Unknown variable");
+		return r < 0 ? 0 : r;
+	}
+
+	rv_shader_error(cc, "Expected expression");
+	return 0;
+}
+
+static int rv_shader_unary(rv_shader_cc *cc) {
+	int r;
+	if (rv_shader_accept(cc, '-')) {
+		r = rv_shader_unary(cc);
+		return rv_shader_emit(cc, RV_OP_NEG, r, r, -1);
+	}
+	return rv_shader_primary(cc);
+}
+
+static int rv_shader_mul(rv_shader_cc *cc) {
+	int a = rv_shader_unary(cc);
+	while (!cc->error) {
+		int op;
+		if      (rv_shader_accept(cc, '*')) op = RV_OP_MUL;
+		else if (rv_shader_accept(cc, '/')) op = RV_OP_DIV;
+		else if (rv_shader_accept(cc, '%')) op = RV_OP_MOD;
+		else break;
+		a = rv_shader_emit(cc, op, a, rv_shader_unary(cc), -1);
+	}
+	return a;
+}
+
+static int rv_shader_add(rv_shader_cc *cc) {
+	int a = rv_shader_mul(cc);
+	while (!cc->error) {
+		int op;
+		if      (rv_shader_accept(cc, '+')) op = RV_OP_ADD;
+		else if (rv_shader_accept(cc, '-')) op = RV_OP_SUB;
+		else break;
+		a = rv_shader_emit(cc, op, a, rv_shader_mul(cc), -1);
+	}
+	return a;
+}
+
+static int rv_shader_expr(rv_shader_cc *cc) {
+	int a = rv_shader_add(cc);
+	while (!cc->error) {
+		int op;
+		if      (rv_shader_accept(cc, '<')) op = RV_OP_LT;
+		else if (rv_shader_accept(cc, '>')) op = RV_OP_GT;
+		else break;
+		a = rv_shader_emit(cc, op, a, rv_shader_add(cc), -1);
+	}
+	return a;
+}
+
+static void rv_shader_statement(rv_shader_cc *cc) {
+	char name[RV_SHADER_MAX_NAME+1];
+	int var, r;
+	rv_shader_insn *last;
+
+	if (!rv_shader_ident(cc, name)) {
+		rv_shader_error(cc, "Expected variable name");
+		return;
+	}
+	if (!rv_shader_accept(cc, '=')) {
+		rv_shader_error(cc, "Expected '='");
+		return;
+	}
+
+	var = rv_shader_find(cc, name);
+	if (var >= 0 && var < RV_REG_R) {
+		rv_shader_error(cc, "Cannot assign to an input");
+		return;
+	}
+
+	r = rv_shader_expr(cc);
+	if (cc->error) return;
+
+	// Anonymous per-frame result: just give it the name
+	if (var != RV_REG_R && var != RV_REG_G && var != RV_REG_B &&
+	    r >= RV_NUM_FIXED_REGS && r < cc->num_named && !cc->is_const[r] && cc->names[r][0] == 0) {
+		strcpy(cc->names[r], name);
+		return;
+	}
+
+	if (var != RV_REG_R && var != RV_REG_G && var != RV_REG_B) var = rv_shader_alloc_named(cc, name);
+	if (cc->error) return;
+
+	// Retarget the per-key instruction that produced a temporary result,
+	// instead of emitting a move.
+	last = cc->prog->num_varying ? &cc->prog->varying[cc->prog->num_varying-1] : NULL;
+	if (r > cc->temp && last && last->dst == r) {
+		last->dst = var;
+		cc->is_const[var]   = 0;
+		cc->is_uniform[var] = 0;
+		return;
+	}
+
+	rv_shader_emit(cc, RV_OP_MOV, r, r, var);
+}
+
+rv_shader *rv_shader_compile(const char *src) {
+	rv_shader_cc cc;
+	int i;
+
+	memset(&cc, 0, sizeof(cc));
+	cc.prog = calloc(1, sizeof(rv_shader));
+	if (!cc.prog) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to allocate memory for shader\n");
+		return NULL;
+	}
+	cc.src  = src;
+	cc.pos  = src;
+	cc.temp = RV_SHADER_REGS - 1;
+
+	for (i = 0; i < RV_NUM_FIXED_REGS; i++) rv_shader_alloc_named(&cc, rv_shader_fixed_names[i]);
+	cc.is_uniform[RV_REG_T] = 1;
+	cc.is_uniform[RV_REG_H] = 1;
+
+	while (!cc.error) {
+		int c = rv_shader_peek(&cc);
+		if (c == 0) break;
+		if (c == ';' || c == '\n') { cc.pos++; continue; }
+		rv_shader_statement(&cc);
+		// Temporaries are only live within a statement
+		cc.temp = RV_SHADER_REGS - 1;
+		c = rv_shader_peek(&cc);
+		if (!cc.error && c != 0 && c != ';' && c != '\n') rv_shader_error(&cc, "Expected ';'");
+	}
+
+	if (cc.error) {
+		free(cc.prog);
+		return NULL;
+	}
+
+	rv_printf(RV_LOG_VERBOSE, "Shader compiled: %d per-frame and %d per-key instructions, %d registers\n",
+		cc.prog->num_uniform, cc.prog->num_varying, cc.num_named);
+
+	return cc.prog;
+}
+
+static void rv_shader_run_uniform(rv_shader *prog) {
+	int i;
+	for (i = 0; i < prog->num_uniform; i++) {
+		rv_shader_insn *in = &prog->uniform[i];
+		prog->reg[in->dst][0] = rv_shader_apply(in->op, prog->reg[in->a][0], prog->reg[in->b][0]);
+	}
+}
+
+static void rv_shader_run_varying(rv_shader *prog) {
+	int i, k;
+
+	for (i = 0; i < prog->num_bcast; i++) {
+		float *r = prog->reg[prog->bcast[i]];
+		for (k = 1; k < RV_NUM_KEYS; k++) r[k] = r[0];
+	}
+
+	for (i = 0; i < prog->num_varying; i++) {
+		rv_shader_insn *in = &prog->varying[i];
+		float *d = prog->reg[in->dst];
+		float *a = prog->reg[in->a];
+		float *b = prog->reg[in->b];
+
+		switch (in->op) {
+			case RV_OP_MOV:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k]; break;
+			case RV_OP_NEG:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = -a[k]; break;
+			case RV_OP_ADD:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] + b[k]; break;
+			case RV_OP_SUB:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] - b[k]; break;
+			case RV_OP_MUL:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] * b[k]; break;
+			case RV_OP_LT:    for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] < b[k]; break;
+			case RV_OP_GT:    for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] > b[k]; break;
+			case RV_OP_ABS:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = fabsf(a[k]); break;
+			case RV_OP_MIN:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] < b[k] ? a[k] : b[k]; break;
+			case RV_OP_MAX:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = a[k] > b[k] ? a[k] : b[k]; break;
+			case RV_OP_SIN:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = sinf(a[k]); break;
+			case RV_OP_COS:   for (k = 0; k < RV_NUM_KEYS; k++) d[k] = cosf(a[k]); break;
+			case RV_OP_FLOOR: for (k = 0; k < RV_NUM_KEYS; k++) d[k] = floorf(a[k]); break;
+			default:          for (k = 0; k < RV_NUM_KEYS; k++) d[k] = rv_shader_apply(in->op, a[k], b[k]); break;
+		}
+	}
+}
+
+// Evaluate the program for all keys and convert the output registers
+static void rv_shader_eval(rv_shader *prog, rv_rgb_map *map) {
+	int k;
+	float *r = prog->reg[RV_REG_R];
+	float *g = prog->reg[RV_REG_G];
+	float *b = prog->reg[RV_REG_B];
+
+	rv_shader_run_uniform(prog);
+	rv_shader_run_varying(prog);
+
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		map->key[k].r = (int16_t)(r[k] > 32767.0f ? 32767.0f : r[k] < -32768.0f ? -32768.0f : r[k]);
+		map->key[k].g = (int16_t)(g[k] > 32767.0f ? 32767.0f : g[k] < -32768.0f ? -32768.0f : g[k]);
+		map->key[k].b = (int16_t)(b[k] > 32767.0f ? 32767.0f : b[k] < -32768.0f ? -32768.0f : b[k]);
+	}
+}
+
+// Breadth-first hop distances from key n0 through the neighbor graph
+static void rv_shader_distances(rv_shader *prog, unsigned char n0) {
+	unsigned char queue[RV_NUM_KEYS];
+	int head = 0, tail = 0, i;
+	float *d = prog->reg[RV_REG_D];
+
+	for (i = 0; i < RV_NUM_KEYS; i++) d[i] = RV_SHADER_FAR;
+	d[n0] = 0.0f;
+	queue[tail++] = n0;
+
+	while (head < tail) {
+		unsigned char n = queue[head++];
+		for (i = 0; i < RV_MAX_NEIGH; i++) {
+			unsigned char n1 = rv_neigh[rv_topo_model][n][i];
+			if (n1 == 0xff) break;
+			if (d[n1] != RV_SHADER_FAR) continue;
+			d[n1] = d[n] + 1.0f;
+			queue[tail++] = n1;
+		}
+	}
+}
+
+static double rv_shader_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void rv_fx_shader(rv_shader *prog) {
+	rv_rgb_map map;
+	rv_key_event kev;
+	float last_press[RV_NUM_KEYS];
+	double start, t0, eval_sum = 0, eval_max = 0;
+	int k, frames = 0;
+
+	rv_key_pos_init();
+	for (k = 0; k < RV_NUM_KEYS; k++) {
+		prog->reg[RV_REG_K][k] = k;
+		prog->reg[RV_REG_X][k] = (rv_key_col[k] == 0xff) ? -1.0f : rv_key_col[k];
+		prog->reg[RV_REG_Y][k] = (rv_key_row[k] == 0xff) ? -1.0f : rv_key_row[k];
+		prog->reg[RV_REG_D][k] = RV_SHADER_FAR;
+		last_press[k] = -RV_SHADER_NEVER;
+	}
+
+	if (rv_init_evdev(0) != RV_SUCCESS) {
+		rv_printf(RV_LOG_NORMAL, "Error: No event input device found\n");
+		return;
+	}
+
+	start = rv_clock_usec() / 1e6;
+
+	while (1) {
+		float t = rv_clock_usec() / 1e6 - start;
+
+		rv_update_evdev();
+
+		while (rv_next_key_event(&kev)) {
+			if (kev.value != RV_KEY_PRESSED) continue;
+			last_press[kev.key] = kev.usec / 1e6 - start;
+			rv_shader_distances(prog, kev.key);
+		}
+
+		t0 = rv_shader_now();
+		prog->reg[RV_REG_T][0] = t;
+		prog->reg[RV_REG_H][0] = rv_keyset_count(&rv_keys_down);
+		for (k = 0; k < RV_NUM_KEYS; k++) {
+			prog->reg[RV_REG_P][k] = t - last_press[k];
+			prog->reg[RV_REG_A][k] = rv_keyset_has(&rv_keys_down, k);
+		}
+		rv_shader_eval(prog, &map);
+		t0 = rv_shader_now() - t0;
+
+		// Report interpreter cost every ~10 seconds
+		eval_sum += t0;
+		if (t0 > eval_max) eval_max = t0;
+		if (++frames == 300) {
+			rv_printf(RV_LOG_VERBOSE, "Shader: %.1fus avg, %.1fus max per frame\n", eval_sum / frames * 1e6, eval_max * 1e6);
+			eval_sum = eval_max = 0;
+			frames = 0;
+		}
+
+		rv_ctl_poll();
+		rv_send_led_map(&map);
+
+		// Runs at ~30fps
+		rv_frame_end();
+	}
+}
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "roccat-vulcan.h"
+
+// System load meter effect.
+//   F-key row   : One key per CPU core (busy time)
+//   Number row  : Memory in use, as a bar
+//   Numpad      : Disk busy time of the busiest disk, as a bar
+//
+// The /proc files are kept open and re-read with pread(). Sampling runs
+// at its own rate, and the frame loop eases towards the latest sample.
+
+#define RV_LOAD_SAMPLE_MS  500
+#define RV_LOAD_EASE       12
+#define RV_LOAD_BUF_LEN    65536
+#define RV_LOAD_MAX_CPUS   256
+#define RV_LOAD_MAX_DISKS  64
+
+// First column of the navigation block and the numpad, first numpad row
+#define RV_LOAD_NAV_COL    14
+#define RV_LOAD_NUMPAD_COL 17
+#define RV_LOAD_NUMPAD_ROW 1
+
+typedef struct rv_load_sample_type {
+	int num_cpus;
+	unsigned long long cpu_busy[RV_LOAD_MAX_CPUS];
+	unsigned long long cpu_total[RV_LOAD_MAX_CPUS];
+	unsigned long long mem_total;
+	unsigned long long mem_avail;
+	int num_disks;
+	unsigned long long disk_ticks[RV_LOAD_MAX_DISKS];
+	struct timespec when;
+} rv_load_sample;
+
+static char rv_load_buf[RV_LOAD_BUF_LEN];
+static rv_load_sample rv_load_prev, rv_load_cur;
+
+static int rv_load_read(int fd) {
+	int len = pread(fd, rv_load_buf, RV_LOAD_BUF_LEN - 1, 0);
+	if (len < 0) len = 0;
+	rv_load_buf[len] = 0;
+	return len;
+}
+
+static const char *rv_load_next_line(const char *p) {
+	while (*p && *p != '\n') p++;
+	return *p ? p + 1 : p;
+}
+
+// Parse the next unsigned number on the current line. Leaves *p after it.
+static unsigned long long rv_load_number(const char **p) {
+	unsigned long long val = 0;
+	while (**p == ' ' || **p == '\t') (*p)++;
+	while (**p >= '0' && **p <= '9') val = val * 10 + (*(*p)++ - '0');
+	return val;
+}
+
+static void rv_load_parse_stat(rv_load_sample *s) {
+	const char *p = rv_load_buf;
+	s->num_cpus = 0;
+
+	while (*p) {
+		// Per-CPU lines only ("cpu0 ..."), not the summary line
+		if (p[0] == 'c' && p[1] == 'p' && p[2] == 'u' && p[3] >= '0' && p[3] <= '9' && s->num_cpus < RV_LOAD_MAX_CPUS) {
+			unsigned long long v, total = 0, idle = 0;
+			int field;
+			p += 3;
+			rv_load_number(&p);
+			// user nice system idle iowait irq softirq steal
+			for (field = 0; field < 8; field++) {
+				v = rv_load_number(&p);
+				total += v;
+				if (field == 3 || field == 4) idle += v;
+			}
+			s->cpu_busy[s->num_cpus]  = total - idle;
+			s->cpu_total[s->num_cpus] = total;
+			s->num_cpus++;
+		}
+		p = rv_load_next_line(p);
+	}
+}
+
+static void rv_load_parse_meminfo(rv_load_sample *s) {
+	const char *p = rv_load_buf;
+
+	while (*p) {
+		if (strncmp(p, "MemTotal:", 9) == 0) {
+			p += 9;
+			s->mem_total = rv_load_number(&p);
+		}
+		else if (strncmp(p, "MemAvailable:", 13) == 0) {
+			p += 13;
+			s->mem_avail = rv_load_number(&p);
+		}
+		p = rv_load_next_line(p);
+	}
+}
+
+static void rv_load_parse_diskstats(rv_load_sample *s) {
+	const char *p = rv_load_buf;
+	s->num_disks = 0;
+
+	while (*p && s->num_disks < RV_LOAD_MAX_DISKS) {
+		int field;
+		const char *name;
+
+		// major minor name, then io_ticks is the 10th stat field
+		rv_load_number(&p);
+		rv_load_number(&p);
+		while (*p == ' ') p++;
+		name = p;
+		while (*p && *p != ' ' && *p != '\n') p++;
+
+		if (strncmp(name, "loop", 4) != 0 && strncmp(name, "ram", 3) != 0) {
+			for (field = 0; field < 9; field++) rv_load_number(&p);
+			s->disk_ticks[s->num_disks++] = rv_load_number(&p);
+		}
+		p = rv_load_next_line(p);
+	}
+}
+
+static void rv_load_sample_all(int stat_fd, int mem_fd, int disk_fd, rv_load_sample *s) {
+	clock_gettime(CLOCK_MONOTONIC, &s->when);
+	if (rv_load_read(stat_fd)) rv_load_parse_stat(s);
+	if (rv_load_read(mem_fd))  rv_load_parse_meminfo(s);
+	if (disk_fd >= 0 && rv_load_read(disk_fd)) rv_load_parse_diskstats(s);
+}
+
+// Green (idle) over yellow to red (busy)
+static rv_rgb rv_load_color(float f) {
+	rv_rgb c;
+	if (f < 0) f = 0;
+	if (f > 1) f = 1;
+	c.r = (f < 0.5f) ? (int16_t)(f * 2 * 255) : 255;
+	c.g = (f < 0.5f) ? 255 : (int16_t)((1 - f) * 2 * 255);
+	c.b = 0;
+	return c;
+}
+
+static void rv_load_bar(rv_rgb_map *map, unsigned char *keys, int num_keys, float f) {
+	int i;
+	for (i = 0; i < num_keys; i++) {
+		if (f * num_keys > i) map->key[keys[i]] = rv_load_color((float)i / num_keys);
+	}
+}
+
+static void rv_load_render(rv_rgb_map *target) {
+	unsigned char mem_keys[RV_MAX_KEYS_PER_ROW];
+	int num_mem_keys = 0;
+	int num_cpu_keys = 0;
+	int i, j, k;
+	float f;
+	long long ms = (rv_load_cur.when.tv_sec  - rv_load_prev.when.tv_sec) * 1000 +
+	               (rv_load_cur.when.tv_nsec - rv_load_prev.when.tv_nsec) / 1000000;
+
+	for (k = 0; k < RV_NUM_KEYS; k++) target->key[k] = rv_colors[0];
+
+	// CPUs. With more cores than keys, a key shows the busiest of its cores.
+	while (num_cpu_keys < RV_MAX_KEYS_PER_ROW && rv_rows[rv_topo_model][0][num_cpu_keys] != 0xff) num_cpu_keys++;
+	for (i = 0; i < num_cpu_keys && i < rv_load_cur.num_cpus; i++) {
+		unsigned char key = rv_rows[rv_topo_model][0][i];
+		f = 0;
+		for (j = i; j < rv_load_cur.num_cpus; j += num_cpu_keys) {
+			// iowait can go backwards, so the busy time can shrink
+			long long total = (long long)(rv_load_cur.cpu_total[j] - rv_load_prev.cpu_total[j]);
+			long long busy  = (long long)(rv_load_cur.cpu_busy[j]  - rv_load_prev.cpu_busy[j]);
+			if (busy < 0) busy = 0;
+			if (busy > total) busy = total;
+			if (total > 0 && (float)busy / total > f) f = (float)busy / total;
+		}
+		target->key[key] = rv_load_color(f);
+	}
+
+	// Memory, on the main block of the number row
+	for (i = 0; i < RV_MAX_KEYS_PER_ROW; i++) {
+		unsigned char key = rv_rows[rv_topo_model][1][i];
+		if (key == 0xff || rv_key_col[key] >= RV_LOAD_NAV_COL) break;
+		mem_keys[num_mem_keys++] = key;
+	}
+	if (rv_load_cur.mem_total) {
+		rv_load_bar(target, mem_keys, num_mem_keys, 1.0f - (float)rv_load_cur.mem_avail / rv_load_cur.mem_total);
+	}
+
+	// Disk, as a bar growing from the bottom of the numpad
+	f = 0;
+	for (i = 0; i < rv_load_cur.num_disks && i < rv_load_prev.num_disks && ms > 0; i++) {
+		float busy = (float)(long long)(rv_load_cur.disk_ticks[i] - rv_load_prev.disk_ticks[i]) / ms;
+		if (busy > f) f = busy;
+	}
+	for (i = RV_LOAD_NUMPAD_COL; i < RV_NUM_COLS; i++) {
+		for (j = 0; j < RV_MAX_KEYS_PER_COL; j++) {
+			unsigned char key = rv_cols[rv_topo_model][i][j];
+			int height;
+			if (key == 0xff) break;
+			if (rv_key_row[key] < RV_LOAD_NUMPAD_ROW) continue;
+			height = RV_NUM_ROWS - rv_key_row[key];
+			if (f * (RV_NUM_ROWS - RV_LOAD_NUMPAD_ROW) > height - 1) {
+				target->key[key] = rv_load_color((float)(height - 1) / (RV_NUM_ROWS - RV_LOAD_NUMPAD_ROW));
+			}
+		}
+	}
+}
+
+void rv_fx_sysload() {
+	rv_rgb_map map, target;
+	int stat_fd, mem_fd, disk_fd, k;
+	struct timespec now;
+
+	stat_fd = open("/proc/stat", O_RDONLY);
+	mem_fd  = open("/proc/meminfo", O_RDONLY);
+	disk_fd = open("/proc/diskstats", O_RDONLY);
+	if (stat_fd < 0 || mem_fd < 0) {
+		rv_printf(RV_LOG_NORMAL, "Error: Unable to open /proc files: %s\n", strerror(errno));
+		if (stat_fd >= 0) close(stat_fd);
+		if (mem_fd >= 0)  close(mem_fd);
+		if (disk_fd >= 0) close(disk_fd);
+		return;
+	}
+	if (disk_fd < 0) rv_printf(RV_LOG_VERBOSE, "No /proc/diskstats, disk meter disabled\n");
+
+	rv_key_pos_init();
+
+	rv_load_sample_all(stat_fd, mem_fd, disk_fd, &rv_load_cur);
+	rv_load_prev = rv_load_cur;
+	for (k = 0; k < RV_NUM_KEYS; k++) map.key[k] = rv_colors[0];
+
+	rv_load_render(&target);
+
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if ((now.tv_sec  - rv_load_cur.when.tv_sec) * 1000 +
+		    (now.tv_nsec - rv_load_cur.when.tv_nsec) / 1000000 >= RV_LOAD_SAMPLE_MS) {
+			rv_load_prev = rv_load_cur;
+			rv_load_sample_all(stat_fd, mem_fd, disk_fd, &rv_load_cur);
+			rv_load_render(&target);
+		}
+
+		rv_ctl_poll();
+		rv_ease_to(&map, &target, RV_LOAD_EASE);
+		rv_send_led_map(&map);
+
+		// Runs at ~30fps
+		if (rv_frame_end()) break;
+	}
+
+	close(stat_fd);
+	close(mem_fd);
+	if (disk_fd >= 0) close(disk_fd);
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+
+// Virtual ROCCAT Vulcan for benchmarks without a keyboard.
+//
+// Creates the keyboard, control and LED interfaces of a Vulcan through
+// /dev/uhid, so roccat-vulcan finds them like the real thing through
+// udev and talks to them through hidraw. Feature reports are answered
+// like the firmware does it, and every LED output report is timestamped.
+//
+//   sudo ./vulcan-uhid -o reports.log &
+//   roccat-vulcan -s 'r = sin(t*3 + x)*127+128'
+//
+// Prints startup time (first open of a device to first complete LED
+// frame), frames per second and time per frame transfer.
+
+#define VU_VENDOR         0x1e7d
+#define VU_LED_CHUNKS     7
+#define VU_MAX_REPORT     443
+#define VU_BUSY_MS        20
+
+enum vu_interfaces {
+	VU_KBD,
+	VU_CTRL,
+	VU_LED,
+	VU_NUM_INTERFACES
+};
+
+static const int vu_interface_numbers[VU_NUM_INTERFACES] = { 0, 1, 3 };
+
+// Boot keyboard, so input devices are created for the keyboard interface
+static const unsigned char vu_kbd_rd[] = {
+	0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7,
+	0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+	0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+	0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+	0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+	0x81, 0x00, 0xc0
+};
+
+// One 64 byte output report without ID
+static const unsigned char vu_led_rd[] = {
+	0x06, 0x00, 0xff, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x02, 0x15, 0x00, 0x26,
+	0xff, 0x00, 0x75, 0x08, 0x95, 0x40, 0x91, 0x02, 0xc0
+};
+
+// Feature reports of the control interface: ID and length with ID
+static const struct { unsigned char id; int length; } vu_ctrl_reports[] = {
+	{ 0x04, 4 }, { 0x05, 4 }, { 0x06, 133 }, { 0x07, 95 }, { 0x09, 43 }, { 0x0a, 8 },
+	{ 0x0b, 65 }, { 0x0d, 443 }, { 0x0f, 8 }, { 0x13, 8 }, { 0x15, 3 }
+};
+#define VU_NUM_CTRL_REPORTS (sizeof(vu_ctrl_reports) / sizeof(vu_ctrl_reports[0]))
+
+static int vu_fd[VU_NUM_INTERFACES];
+static volatile sig_atomic_t vu_stop = 0;
+static FILE *vu_log = NULL;
+
+// Last value of every control report, as set by the host
+static unsigned char vu_reports[256][VU_MAX_REPORT];
+static int vu_report_length[256];
+static uint64_t vu_ready_at = 0;
+
+// Statistics
+static uint64_t vu_first_open = 0;
+static uint64_t vu_first_frame = 0;
+static uint64_t vu_frame_start = 0;
+static int vu_chunk = -1;
+static uint64_t vu_frames = 0, vu_reports_seen = 0, vu_sets = 0;
+static uint64_t vu_transfer_sum = 0, vu_transfer_max = 0;
+static uint64_t vu_window_start, vu_window_frames = 0;
+
+static uint64_t vu_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int vu_ctrl_rd(unsigned char *rd) {
+	int n = 0;
+	unsigned int i;
+
+	memcpy(rd + n, "\x06\x00\xff\x09\x01\xa1\x01", 7);
+	n += 7;
+	for (i = 0; i < VU_NUM_CTRL_REPORTS; i++) {
+		int count = vu_ctrl_reports[i].length - 1;
+		rd[n++] = 0x85; rd[n++] = vu_ctrl_reports[i].id;            // Report ID
+		rd[n++] = 0x09; rd[n++] = vu_ctrl_reports[i].id;            // Usage
+		rd[n++] = 0x15; rd[n++] = 0x00;                             // Logical minimum
+		rd[n++] = 0x26; rd[n++] = 0xff; rd[n++] = 0x00;             // Logical maximum
+		rd[n++] = 0x75; rd[n++] = 0x08;                             // Report size
+		rd[n++] = 0x96; rd[n++] = count & 0xff; rd[n++] = count >> 8; // Report count
+		rd[n++] = 0xb1; rd[n++] = 0x02;                             // Feature
+	}
+	rd[n++] = 0xc0;
+
+	return n;
+}
+
+static int vu_send(int fd, struct uhid_event *ev) {
+	if (write(fd, ev, sizeof(*ev)) != sizeof(*ev)) {
+		fprintf(stderr, "Error: Unable to write to /dev/uhid: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int vu_create(int itf, unsigned short product) {
+	struct uhid_event ev;
+	unsigned char rd[HID_MAX_DESCRIPTOR_SIZE];
+	int rd_size;
+
+	vu_fd[itf] = open("/dev/uhid", O_RDWR|O_CLOEXEC);
+	if (vu_fd[itf] < 0) {
+		fprintf(stderr, "Error: Unable to open /dev/uhid: %s\n", strerror(errno));
+		return -1;
+	}
+
+	switch (itf) {
+		case VU_KBD:  rd_size = sizeof(vu_kbd_rd); memcpy(rd, vu_kbd_rd, rd_size); break;
+		case VU_CTRL: rd_size = vu_ctrl_rd(rd); break;
+		default:      rd_size = sizeof(vu_led_rd); memcpy(rd, vu_led_rd, rd_size); break;
+	}
+
+	// udev matches on HID_ID (bus, vendor, product) and the interface
+	// number at the end of HID_PHYS, like usbhid sets it
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "ROCCAT Vulcan (virtual)");
+	snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys), "uhid-vulcan/input%d", vu_interface_numbers[itf]);
+	ev.u.create2.rd_size = rd_size;
+	ev.u.create2.bus     = BUS_USB;
+	ev.u.create2.vendor  = VU_VENDOR;
+	ev.u.create2.product = product;
+	memcpy(ev.u.create2.rd_data, rd, rd_size);
+
+	return vu_send(vu_fd[itf], &ev);
+}
+
+static void vu_get_report(int fd, struct uhid_get_report_req *req) {
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+
+	if (req->rnum == 0x04) {
+		// Readiness, 0x01 once the last report has been taken in
+		ev.u.get_report_reply.size = 4;
+		ev.u.get_report_reply.data[0] = 0x04;
+		ev.u.get_report_reply.data[1] = vu_now() >= vu_ready_at ? 0x01 : 0x00;
+	}
+	else if (vu_report_length[req->rnum]) {
+		ev.u.get_report_reply.size = vu_report_length[req->rnum];
+		memcpy(ev.u.get_report_reply.data, vu_reports[req->rnum], vu_report_length[req->rnum]);
+	}
+	else if (req->rnum == 0x0f) {
+		ev.u.get_report_reply.size = 8;
+		ev.u.get_report_reply.data[0] = 0x0f;
+	}
+	else {
+		// Not set since the device was created, like after power on
+		ev.u.get_report_reply.err = EIO;
+	}
+
+	vu_send(fd, &ev);
+}
+
+static void vu_set_report(int fd, struct uhid_set_report_req *req) {
+	struct uhid_event ev;
+	int len = req->size > VU_MAX_REPORT ? VU_MAX_REPORT : req->size;
+
+	memcpy(vu_reports[req->rnum], req->data, len);
+	vu_report_length[req->rnum] = len;
+	vu_ready_at = vu_now() + VU_BUSY_MS * 1000;
+	vu_sets++;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+	vu_send(fd, &ev);
+}
+
+static void vu_output(struct uhid_output_req *req) {
+	const unsigned char *data = req->data;
+	int size = req->size;
+	uint64_t now = vu_now();
+
+	// hidraw passes the report ID byte on, which is 0 here
+	if (size == 65 && data[0] == 0x00) { data++; size--; }
+	vu_reports_seen++;
+
+	// The first chunk of a frame starts with a header
+	if (size >= 4 && data[0] == 0xa1 && data[1] == 0x01 && data[2] == 0x01 && data[3] == 0xb4) {
+		vu_chunk = 0;
+		vu_frame_start = now;
+	}
+	else if (vu_chunk >= 0) {
+		vu_chunk++;
+	}
+
+	if (vu_log) fprintf(vu_log, "%llu.%06llu led %d\n", (unsigned long long)(now / 1000000), (unsigned long long)(now % 1000000), vu_chunk);
+
+	if (vu_chunk == VU_LED_CHUNKS - 1) {
+		uint64_t transfer = now - vu_frame_start;
+		vu_frames++;
+		vu_window_frames++;
+		vu_transfer_sum += transfer;
+		if (transfer > vu_transfer_max) vu_transfer_max = transfer;
+		if (!vu_first_frame) {
+			vu_first_frame = now;
+			printf("First frame %.1fms after the first open, %llu control reports set\n",
+				(vu_first_frame - vu_first_open) / 1e3, (unsigned long long)vu_sets);
+		}
+		vu_chunk = -1;
+	}
+}
+
+static void vu_handle(int itf) {
+	struct uhid_event ev;
+	ssize_t res = read(vu_fd[itf], &ev, sizeof(ev));
+
+	if (res <= 0) return;
+
+	switch (ev.type) {
+		case UHID_OPEN:
+			if (!vu_first_open) vu_first_open = vu_now();
+		break;
+		case UHID_OUTPUT:
+			if (itf == VU_LED) vu_output(&ev.u.output);
+		break;
+		case UHID_GET_REPORT:
+			vu_get_report(vu_fd[itf], &ev.u.get_report);
+		break;
+		case UHID_SET_REPORT:
+			vu_set_report(vu_fd[itf], &ev.u.set_report);
+		break;
+	}
+}
+
+static void vu_report(uint64_t now) {
+	printf("%.1f fps, %llu frames, transfer %.0fus avg, %lluus max\n",
+		vu_window_frames * 1e6 / (now - vu_window_start), (unsigned long long)vu_frames,
+		vu_frames ? (double)vu_transfer_sum / vu_frames : 0.0, (unsigned long long)vu_transfer_max);
+	vu_window_start = now;
+	vu_window_frames = 0;
+}
+
+static void vu_on_signal(int sig) {
+	(void)sig;
+	vu_stop = 1;
+}
+
+static void show_usage(const char *arg0) {
+	fprintf(stderr, "Usage: %s [-p product] [-o logPath]\n", arg0);
+	fprintf(stderr, "-p [product] : Product ID to report, 307a (default) or 3098.\n");
+	fprintf(stderr, "-o [logPath] : Write a timestamp for every LED report to a file.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct pollfd fds[VU_NUM_INTERFACES];
+	unsigned short product = 0x307a;
+	int opt, itf;
+
+	while ((opt = getopt(argc, argv, "hp:o:")) != -1) {
+		switch (opt) {
+			case 'p':
+				product = strtoul(optarg, NULL, 16);
+			break;
+			case 'o':
+				vu_log = fopen(optarg, "w");
+				if (!vu_log) {
+					fprintf(stderr, "Error: Unable to create '%s': %s\n", optarg, strerror(errno));
+					return 1;
+				}
+			break;
+			default:
+				show_usage(argv[0]);
+		}
+	}
+
+	signal(SIGINT, vu_on_signal);
+	signal(SIGTERM, vu_on_signal);
+
+	for (itf = 0; itf < VU_NUM_INTERFACES; itf++) {
+		if (vu_create(itf, product) < 0) return 1;
+		fds[itf].fd = vu_fd[itf];
+		fds[itf].events = POLLIN;
+	}
+	printf("Virtual keyboard %04x:%04x created, waiting for roccat-vulcan\n", VU_VENDOR, product);
+
+	vu_window_start = vu_now();
+	while (!vu_stop) {
+		uint64_t now;
+
+		if (poll(fds, VU_NUM_INTERFACES, 1000) < 0 && errno != EINTR) break;
+		for (itf = 0; itf < VU_NUM_INTERFACES; itf++) {
+			if (fds[itf].revents & POLLIN) vu_handle(itf);
+		}
+
+		now = vu_now();
+		if (now - vu_window_start >= 1000000) vu_report(now);
+	}
+
+	vu_report(vu_now());
+	for (itf = 0; itf < VU_NUM_INTERFACES; itf++) {
+		struct uhid_event ev = { .type = UHID_DESTROY };
+		vu_send(vu_fd[itf], &ev);
+		close(vu_fd[itf]);
+	}
+	if (vu_log) fclose(vu_log);
+
+	return 0;
+}
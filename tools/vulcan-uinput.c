@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/uinput.h>
+
+// Input load generator for roccat-vulcan.
+//
+// Creates a virtual keyboard through /dev/uinput with the vendor and
+// product IDs of a Vulcan, so roccat-vulcan picks it up as one of the
+// keyboard's event devices, and types on it at a fixed rate. With -m,
+// the daemon's metrics are read every second to show how many events it
+// consumed, how many are still queued in the kernel and how many were
+// dropped:
+//
+//   sudo ./vulcan-uinput -r 20000 -t 10 -m /tmp/vulcan.sock
+//
+// Start it first, then start roccat-vulcan within the wait time (-w).
+
+#define VU_VENDOR        0x1e7d
+#define VU_TICK_US       1000
+#define VU_MAX_BATCH     1024
+
+enum vu_patterns {
+	VU_PATTERN_ROLL,    // Press and release, walking over the keys
+	VU_PATTERN_RANDOM,  // Press and release of random keys
+	VU_PATTERN_SAME,    // Press and release of the same key
+	VU_PATTERN_CHORD    // Press all keys of a row, then release them
+};
+
+static const char *vu_pattern_names[] = { "roll", "random", "same", "chord", NULL };
+
+// Keys that exist on every Vulcan layout
+static const unsigned short vu_keys[] = {
+	KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+	KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+	KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M,
+	KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0
+};
+#define VU_NUM_KEYS (sizeof(vu_keys) / sizeof(vu_keys[0]))
+
+static volatile sig_atomic_t vu_stop = 0;
+static const char *vu_metrics_path = NULL;
+
+// Pattern state
+static int vu_pattern = VU_PATTERN_ROLL;
+static unsigned int vu_step = 0;
+static uint32_t vu_rand_state = 0x9e3779b9;
+
+static uint64_t vu_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint32_t vu_rand() {
+	uint32_t x = vu_rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return vu_rand_state = x;
+}
+
+static int vu_create(unsigned short product) {
+	struct uinput_setup setup;
+	unsigned int k;
+	int fd = open("/dev/uinput", O_WRONLY|O_CLOEXEC);
+
+	if (fd < 0) {
+		fprintf(stderr, "Error: Unable to open /dev/uinput: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// No EV_REP, the kernel must not add repeats of its own
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	for (k = 0; k < VU_NUM_KEYS; k++) ioctl(fd, UI_SET_KEYBIT, vu_keys[k]);
+
+	memset(&setup, 0, sizeof(setup));
+	setup.id.bustype = BUS_USB;
+	setup.id.vendor  = VU_VENDOR;
+	setup.id.product = product;
+	snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "ROCCAT Vulcan (load generator)");
+
+	if (ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+		fprintf(stderr, "Error: Unable to create the uinput device: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void vu_add(struct input_event *ev, int *n, unsigned short type, unsigned short code, int value) {
+	memset(&ev[*n], 0, sizeof(ev[*n]));
+	ev[*n].type  = type;
+	ev[*n].code  = code;
+	ev[*n].value = value;
+	(*n)++;
+}
+
+// Adds the next key event of the pattern, with its SYN_REPORT
+static void vu_next(struct input_event *ev, int *n) {
+	unsigned int key;
+	int value;
+
+	switch (vu_pattern) {
+		case VU_PATTERN_RANDOM:
+			// Release the key pressed in the previous step
+			if (vu_step & 1) { key = vu_rand_state % VU_NUM_KEYS; value = 0; }
+			else             { key = vu_rand() % VU_NUM_KEYS;     value = 1; }
+		break;
+		case VU_PATTERN_SAME:
+			key = 0;
+			value = !(vu_step & 1);
+		break;
+		case VU_PATTERN_CHORD:
+			key = vu_step % 10;
+			value = !((vu_step / 10) & 1);
+		break;
+		default:
+			key = (vu_step / 2) % VU_NUM_KEYS;
+			value = !(vu_step & 1);
+		break;
+	}
+	vu_step++;
+
+	vu_add(ev, n, EV_KEY, vu_keys[key], value);
+	vu_add(ev, n, EV_SYN, SYN_REPORT, 0);
+}
+
+// Reads a counter from the daemon's metrics. Counters that are not
+// there, like with older versions, read as 0.
+static int vu_read_metrics(const char **names, uint64_t *values, int num) {
+	struct sockaddr_un addr;
+	static char buf[16384];
+	const char *request = "GET /metrics HTTP/1.0\r\n\r\n";
+	int fd, len = 0, i;
+	ssize_t res;
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", vu_metrics_path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    write(fd, request, strlen(request)) < 0) {
+		close(fd);
+		return -1;
+	}
+	while (len < (int)sizeof(buf) - 1 && (res = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) len += res;
+	buf[len] = 0;
+	close(fd);
+
+	for (i = 0; i < num; i++) {
+		char *line = buf;
+		size_t name_len = strlen(names[i]);
+		values[i] = 0;
+		while ((line = strstr(line, names[i])) != NULL) {
+			// Whole name at the start of a line
+			if ((line == buf || line[-1] == '\n') && line[name_len] == ' ') {
+				values[i] = strtoull(line + name_len + 1, NULL, 10);
+				break;
+			}
+			line += name_len;
+		}
+	}
+
+	return 0;
+}
+
+enum vu_metrics {
+	VU_METRIC_EVENTS,
+	VU_METRIC_DROPPED_KEYS,
+	VU_METRIC_SYN_DROPPED,
+	VU_NUM_METRICS
+};
+
+static const char *vu_metric_names[VU_NUM_METRICS] = {
+	"roccat_vulcan_evdev_events_total",
+	"roccat_vulcan_dropped_keys_total",
+	"roccat_vulcan_evdev_syn_dropped_total"
+};
+
+static void vu_on_signal(int sig) {
+	(void)sig;
+	vu_stop = 1;
+}
+
+static void show_usage(const char *arg0) {
+	fprintf(stderr, "Usage: %s [-r rate] [-t seconds] [-P pattern] [-m socketPath] [-w seconds] [-p product]\n", arg0);
+	fprintf(stderr, "-r [rate]       : Key events per second (default 1000).\n");
+	fprintf(stderr, "-t [seconds]    : Stop after this time (default: run until Ctrl-C).\n");
+	fprintf(stderr, "-P [pattern]    : roll (default), random, same or chord.\n");
+	fprintf(stderr, "-m [socketPath] : Metrics socket of roccat-vulcan, to measure what it consumes.\n");
+	fprintf(stderr, "-w [seconds]    : Wait before typing, to start roccat-vulcan (default 5).\n");
+	fprintf(stderr, "-p [product]    : Product ID to report, 307a (default) or 3098.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct input_event ev[VU_MAX_BATCH];
+	unsigned short product = 0x307a;
+	unsigned int rate = 1000, duration = 0, wait = 5;
+	uint64_t base[VU_NUM_METRICS] = { 0 }, last[VU_NUM_METRICS] = { 0 }, cur[VU_NUM_METRICS];
+	uint64_t start, window_start, now;
+	uint64_t keys_sent = 0, written = 0, window_written = 0, max_consumed = 0;
+	int have_metrics = 0;
+	int opt, fd, i;
+
+	while ((opt = getopt(argc, argv, "hr:t:P:m:w:p:")) != -1) {
+		switch (opt) {
+			case 'r':
+				rate = strtoul(optarg, NULL, 10);
+				if (!rate) show_usage(argv[0]);
+			break;
+			case 't':
+				duration = strtoul(optarg, NULL, 10);
+			break;
+			case 'P':
+				for (i = 0; vu_pattern_names[i] && strcmp(optarg, vu_pattern_names[i]) != 0; i++);
+				if (!vu_pattern_names[i]) show_usage(argv[0]);
+				vu_pattern = i;
+			break;
+			case 'm':
+				vu_metrics_path = optarg;
+			break;
+			case 'w':
+				wait = strtoul(optarg, NULL, 10);
+			break;
+			case 'p':
+				product = strtoul(optarg, NULL, 16);
+			break;
+			default:
+				show_usage(argv[0]);
+		}
+	}
+
+	signal(SIGINT, vu_on_signal);
+	signal(SIGTERM, vu_on_signal);
+
+	fd = vu_create(product);
+	if (fd < 0) return 1;
+	printf("Virtual keyboard %04x:%04x created, typing in %u seconds\n", VU_VENDOR, product, wait);
+	for (i = 0; i < (int)wait && !vu_stop; i++) sleep(1);
+
+	if (vu_metrics_path) {
+		have_metrics = vu_read_metrics(vu_metric_names, base, VU_NUM_METRICS) == 0;
+		if (!have_metrics) fprintf(stderr, "Warning: Unable to read metrics from '%s', only sending\n", vu_metrics_path);
+		memcpy(last, base, sizeof(last));
+	}
+
+	start = window_start = vu_now();
+	while (!vu_stop) {
+		uint64_t due;
+		int n = 0;
+
+		now = vu_now();
+		if (duration && now - start >= duration * 1000000ULL) break;
+
+		// Catch up with the rate, in batches of one write
+		due = (now - start) * rate / 1000000;
+		while (keys_sent < due && n < VU_MAX_BATCH - 1) {
+			vu_next(ev, &n);
+			keys_sent++;
+		}
+		if (n) {
+			if (write(fd, ev, n * sizeof(ev[0])) != (ssize_t)(n * sizeof(ev[0]))) {
+				fprintf(stderr, "Error: Unable to write to /dev/uinput: %s\n", strerror(errno));
+				break;
+			}
+			written += n;
+			window_written += n;
+		}
+
+		if (now - window_start >= 1000000) {
+			double secs = (now - window_start) / 1e6;
+			printf("sent %.0f ev/s", window_written / secs);
+			if (have_metrics && vu_read_metrics(vu_metric_names, cur, VU_NUM_METRICS) == 0) {
+				uint64_t consumed = cur[VU_METRIC_EVENTS] - last[VU_METRIC_EVENTS];
+				int64_t backlog = (int64_t)written - (int64_t)(cur[VU_METRIC_EVENTS] - base[VU_METRIC_EVENTS]);
+				if (consumed / secs > max_consumed) max_consumed = consumed / secs;
+				printf(", consumed %.0f ev/s, behind %lld ev (%.1fms), dropped keys %llu, SYN_DROPPED %llu",
+					consumed / secs, (long long)backlog, consumed ? backlog * 1e3 * secs / consumed : 0.0,
+					(unsigned long long)(cur[VU_METRIC_DROPPED_KEYS] - base[VU_METRIC_DROPPED_KEYS]),
+					(unsigned long long)(cur[VU_METRIC_SYN_DROPPED] - base[VU_METRIC_SYN_DROPPED]));
+				memcpy(last, cur, sizeof(last));
+			}
+			printf("\n");
+			window_start = now;
+			window_written = 0;
+		}
+
+		usleep(VU_TICK_US);
+	}
+
+	// Let the daemon catch up before the final count
+	if (have_metrics) {
+		sleep(1);
+		if (vu_read_metrics(vu_metric_names, cur, VU_NUM_METRICS) == 0) {
+			uint64_t consumed = cur[VU_METRIC_EVENTS] - base[VU_METRIC_EVENTS];
+			printf("Summary: %llu events sent, %llu consumed, %lld lost, %llu dropped keys, %llu SYN_DROPPED, peak %llu ev/s consumed\n",
+				(unsigned long long)written, (unsigned long long)consumed, (long long)written - (long long)consumed,
+				(unsigned long long)(cur[VU_METRIC_DROPPED_KEYS] - base[VU_METRIC_DROPPED_KEYS]),
+				(unsigned long long)(cur[VU_METRIC_SYN_DROPPED] - base[VU_METRIC_SYN_DROPPED]),
+				(unsigned long long)max_consumed);
+		}
+	}
+	else {
+		printf("Summary: %llu events sent in %.1fs\n", (unsigned long long)written, (vu_now() - start) / 1e6);
+	}
+
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+	return 0;
+}